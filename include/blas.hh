@@ -0,0 +1,128 @@
+#ifndef _DL_BLAS_H_
+#define _DL_BLAS_H_
+
+#include <cblas.h>
+
+#include "cpu.hh"
+
+// CPU implementation with CBLAS
+
+///////////////////////////////////
+// CBLAS routines by element type
+///////////////////////////////////
+template <class T>
+struct BLAS;
+
+template <>
+struct BLAS<float> {
+  static void gemm(CBLAS_TRANSPOSE ta, CBLAS_TRANSPOSE tb, int m, int n, int k,
+  float alpha, const float* a, int lda, const float* b, int ldb,
+  float beta, float* c, int ldc) {
+    cblas_sgemm(CblasRowMajor, ta, tb, m, n, k,
+    alpha, a, lda, b, ldb, beta, c, ldc);
+  }
+
+  static void copy(int n, const float* x, int incx, float* y, int incy) {
+    cblas_scopy(n, x, incx, y, incy);
+  }
+
+  static void axpy(int n, float alpha, const float* x, float* y) {
+    cblas_saxpy(n, alpha, x, 1, y, 1);
+  }
+
+  static void scal(int n, float alpha, float* x) {
+    cblas_sscal(n, alpha, x, 1);
+  }
+};
+
+template <>
+struct BLAS<double> {
+  static void gemm(CBLAS_TRANSPOSE ta, CBLAS_TRANSPOSE tb, int m, int n, int k,
+  double alpha, const double* a, int lda, const double* b, int ldb,
+  double beta, double* c, int ldc) {
+    cblas_dgemm(CblasRowMajor, ta, tb, m, n, k,
+    alpha, a, lda, b, ldb, beta, c, ldc);
+  }
+
+  static void copy(int n, const double* x, int incx, double* y, int incy) {
+    cblas_dcopy(n, x, incx, y, incy);
+  }
+
+  static void axpy(int n, double alpha, const double* x, double* y) {
+    cblas_daxpy(n, alpha, x, 1, y, 1);
+  }
+
+  static void scal(int n, double alpha, double* x) {
+    cblas_dscal(n, alpha, x, 1);
+  }
+};
+
+///////////////////////////////////
+// BLAS context
+///////////////////////////////////
+template <class T>
+class BLASContext : public CPUContext<T> {
+  public:
+    void
+    add(const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
+      if (a.rows() != b.rows() || a.cols() != b.cols()) {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+      else if (r.data() == b.data()) {
+        BLAS<T>::axpy(a.size(), 1, a.data(), r.data());
+      }
+      else {
+        if (r.data() != a.data()) {
+          BLAS<T>::copy(a.size(), a.data(), 1, r.data(), 1);
+        }
+        BLAS<T>::axpy(b.size(), 1, b.data(), r.data());
+      }
+    }
+
+    void
+    gemm(bool ta, bool tb, T alpha,
+    const CPUMatrix<T>& a, const CPUMatrix<T>& b, T beta,
+    CPUMatrix<T>& r) const {
+      auto inner = ta ? a.rows() : a.cols();
+      if (inner == 0 || r.size() == 0 || this->fixed(ta, a, r)) {
+        // leave empty and small fixed-size products to the base context
+        CPUContext<T>::gemm(ta, tb, alpha, a, b, beta, r);
+      }
+      else if (!this->gemm_shape(ta, tb, a, b, r)) {
+        this->on_error("dimension mismatch in matrix-product multiplication");
+      }
+      else {
+        BLAS<T>::gemm(ta ? CblasTrans : CblasNoTrans,
+        tb ? CblasTrans : CblasNoTrans, r.rows(), r.cols(), inner,
+        alpha, a.data(), a.cols(), b.data(), b.cols(),
+        beta, r.data(), r.cols());
+      }
+    }
+
+    void
+    mul(const CPUMatrix<T>& a, T s, CPUMatrix<T>& r) const {
+      if (r.data() != a.data()) {
+        BLAS<T>::copy(a.size(), a.data(), 1, r.data(), 1);
+      }
+      BLAS<T>::scal(r.size(), s, r.data());
+    }
+
+    void
+    transpose(const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (r.rows() != a.cols() || r.cols() != a.rows()) {
+        this->on_error("dimension mismatch in matrix transpose");
+      }
+      else if (r.data() == a.data()) {
+        CPUContext<T>::transpose(a, r);
+      }
+      else {
+        // gather each strided column of a into a row of r
+        for (int i=0; i<r.rows(); i++) {
+          BLAS<T>::copy(r.cols(), a.data() + i, a.cols(),
+          r.data() + i * r.cols(), 1);
+        }
+      }
+    }
+};
+
+#endif /*_DL_BLAS_H_*/
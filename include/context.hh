@@ -1,74 +1,375 @@
 #ifndef _DL_CONTEXT_
 #define _DL_CONTEXT_
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <ostream>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "reduce.hh"
+
+// context allocation statistics
+struct ContextStats {
+  std::size_t hits;           // requests served from cache
+  std::size_t misses;         // requests that created a matrix
+  std::size_t arena_hits;     // requests served from a step arena
+  std::size_t arena_misses;   // step requests that fell back to cache
+  std::size_t live_bytes;     // bytes held by matrices in use
+  std::size_t cached_bytes;   // bytes held by cached matrices
+  std::size_t arena_bytes;    // bytes held by step arenas
+  std::size_t peak_bytes;     // peak of all bytes held
+  std::size_t shards;         // thread shards registered
+  std::map<std::pair<std::size_t, std::size_t>, std::size_t> shapes;
+
+  // print statistics as JSON
+  void print(std::ostream& out) const {
+    out << "{";
+    out << "\"hits\":" << hits << ",";
+    out << "\"misses\":" << misses << ",";
+    out << "\"arena_hits\":" << arena_hits << ",";
+    out << "\"arena_misses\":" << arena_misses << ",";
+    out << "\"live_bytes\":" << live_bytes << ",";
+    out << "\"cached_bytes\":" << cached_bytes << ",";
+    out << "\"arena_bytes\":" << arena_bytes << ",";
+    out << "\"peak_bytes\":" << peak_bytes << ",";
+    out << "\"shards\":" << shards << ",";
+    out << "\"shapes\":[";
+    for (auto it = shapes.begin(); it != shapes.end(); it++) {
+      out << ((it != shapes.begin()) ? ",":"");
+      out << "[" << it->first.first << "," << it->first.second << ",";
+      out << it->second << "]";
+    }
+    out << "]}";
+  }
+};
+
+// element-wise ops with a broadcast operand
+enum BroadcastOp {
+  BROADCAST_ADD,
+  BROADCAST_SUB,
+  BROADCAST_MUL,
+};
 
 template<typename T, template <typename> class M>
 class Context {
   public:
     Context() {
       error_handler = NULL;
+      overflow = NULL;
+      shard_limit = 64;
+      pool_limit = SIZE_MAX;
+      cached_bytes = 0;
+      allocated_bytes = 0;
+      arena_bytes = 0;
+      peak_bytes = 0;
+      histogram = false;
+      tick = 0;
+      serial = next_serial();
+      auto& g = global();
+      std::lock_guard<std::mutex> guard(g.lock);
+      g.contexts[serial] = this;
     }
 
-    // clear all cache
+    // clear all cache, forget the shards threads still map to this context
     virtual ~Context() {
-      auto it = matrix_cache.begin();
-      while (it != matrix_cache.end()) {
-        while (it->second->size() > 0) {
-          auto top = it->second->front();
-          it->second->pop();
-          delete top;
+      {
+        auto& g = global();
+        std::lock_guard<std::mutex> guard(g.lock);
+        g.contexts.erase(serial);
+        for (auto l: g.locals) {
+          l->shards.erase(serial);
         }
-        delete it->second;
-        it++;
+      }
+      for (auto s: shards) {
+        clear(s->cache);
+        delete s->arena.region;
+        delete[] s->arena.views;
+        delete s;
+      }
+      auto node = overflow.exchange(NULL);
+      while (node != NULL) {
+        auto next = node->next;
+        delete node->matrix;
+        delete node;
+        node = next;
       }
     }
 
-    // get matrix from cache or create one if does not exist
-    M<T>* get_matrix(std::size_t rows, std::size_t cols) {
-      auto it = matrix_cache.find(pair_hash(rows, cols));
-      if (it != matrix_cache.end() && it->second->size() > 0) {
-        auto top = it->second->front();
-        it->second->pop();
-        return top;
+    // get transient matrix from the step arena if a step is open,
+    // otherwise get matrix from cache or create one if does not exist,
+    // any cached matrix of the same size class can serve the shape
+    M<T>* get_matrix(std::size_t rows, std::size_t cols,
+    bool transient = true) {
+      auto& s = shard();
+      if (histogram) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.shapes[pair_hash(rows, cols)]++;
       }
-      else {
-        return create(rows, cols);
+      if (transient && s.arena.depth > 0) {
+        auto m = bump(s.arena, rows, cols);
+        if (m != NULL) {
+          s.arena_hits++;
+          return m;
+        }
+        s.arena_misses++;
       }
+
+      std::size_t c = size_class(rows * cols);
+      M<T>* top;
+      {
+        std::lock_guard<std::mutex> guard(s.lock);
+        top = pop(s.cache, c);
+        if (top == NULL && drain(s.cache)) {
+          top = pop(s.cache, c);
+        }
+      }
+      if (top == NULL) {
+        s.misses++;
+        auto m = create(rows, cols, class_size(c));
+        allocate(bytes(*m));
+        return m;
+      }
+      s.hits++;
+      cached_bytes -= bytes(*top);
+      reshape(*top, rows, cols);
+      return top;
     }
 
-    // put matrix to cache
+    // put matrix to cache, trim the cache if it grows over the limit
     void put_matrix(M<T>* matrix) {
-      std::size_t h = pair_hash(matrix->rows(), matrix->cols());
-      auto it = matrix_cache.find(h);
-      if (it == matrix_cache.end()) {
-        matrix_cache.insert({h, new std::queue<M<T>*>()});
-        it = matrix_cache.find(h);
+      if (is_transient(*matrix)) {
+        release(matrix);
+        return;
+      }
+
+      std::size_t c = floor_class(capacity(*matrix));
+      std::size_t size = bytes(*matrix);
+      auto& s = shard();
+      bool over;
+      {
+        // counted before trim can see the matrix and subtract its size
+        std::lock_guard<std::mutex> guard(s.lock);
+        over = (cached_bytes += size) > pool_limit;
+        auto& q = slot(s.cache, c);
+        if (q.size() < shard_limit) {
+          q.push_back({tick++, matrix});
+        }
+        else {
+          push(matrix);
+        }
+      }
+      if (over) {
+        trim(pool_limit - pool_limit / 4);
+      }
+    }
+
+    // delete least recently cached matrices until the cache fits in bytes
+    void trim(std::size_t bytes = 0) {
+      collect();
+      std::vector<M<T>*> victims;
+      {
+        std::lock_guard<std::mutex> registry(shards_lock);
+        std::vector<std::unique_lock<std::mutex>> guards;
+        for (auto s: shards) {
+          guards.emplace_back(s->lock);
+        }
+        while (cached_bytes > bytes) {
+          std::deque<Entry>* oldest = NULL;
+          for (auto s: shards) {
+            for (auto& q: s->cache) {
+              if (q.size() > 0 && (oldest == NULL ||
+              q.front().stamp < oldest->front().stamp)) {
+                oldest = &q;
+              }
+            }
+          }
+          if (oldest == NULL) {
+            break;
+          }
+          victims.push_back(oldest->front().matrix);
+          cached_bytes -= this->bytes(*victims.back());
+          oldest->pop_front();
+        }
+      }
+      for (auto m: victims) {
+        allocated_bytes -= this->bytes(*m);
+        delete m;
+      }
+    }
+
+    // open a step on the calling thread, until the matching end_step
+    // transient matrices are bump allocated from one contiguous region,
+    // the region grows to the demand of the previous step; while views
+    // of an earlier step are still in use the arena serves no views
+    void begin_step() {
+      auto& s = shard();
+      auto& a = s.arena;
+      if (a.depth++ > 0) {
+        return;
+      }
+      if (a.live > 0) {
+        a.offset = a.size;
+        a.used = a.count;
+        a.demand = 0;
+        a.requests = 0;
+        return;
+      }
+      if (a.demand > a.size) {
+        if (a.region != NULL) {
+          allocated_bytes -= a.region_bytes;
+          arena_bytes -= a.region_bytes;
+          delete a.region;
+        }
+        a.region = create(1, a.demand, a.demand);
+        a.size = a.demand;
+        a.region_bytes = bytes(*a.region);
+        arena_bytes += a.region_bytes;
+        allocate(a.region_bytes);
+      }
+      if (a.requests > a.count) {
+        std::lock_guard<std::mutex> guard(s.lock);
+        delete[] a.views;
+        a.views = new M<T>[a.requests];
+        a.count = a.requests;
+      }
+      a.offset = 0;
+      a.used = 0;
+      a.demand = 0;
+      a.requests = 0;
+    }
+
+    // close a step on the calling thread, views still in use keep the
+    // arena closed until they are put back
+    void end_step() {
+      auto& a = shard().arena;
+      if (a.depth > 0) {
+        a.depth--;
+      }
+    }
+
+    // get standalone view of region elements from offset,
+    // the view is deleted when put back
+    M<T>* get_view(M<T>& region, std::size_t offset,
+    std::size_t rows, std::size_t cols) {
+      auto m = new M<T>();
+      view(*m, region, offset, rows, cols);
+      return m;
+    }
+
+    // check if matrix is a view into a step arena or region
+    bool is_transient(const M<T>& a) const {
+      return capacity(a) == 0;
+    }
+
+    // round element count up to keep views on 64 byte boundaries
+    static std::size_t align_size(std::size_t n) {
+      std::size_t align = (sizeof(T) < 64) ? 64 / sizeof(T) : 1;
+      return (n + align - 1) / align * align;
+    }
+
+    // get allocation statistics
+    ContextStats get_stats() {
+      collect();
+      ContextStats stats;
+      stats.hits = stats.misses = 0;
+      stats.arena_hits = stats.arena_misses = 0;
+      std::lock_guard<std::mutex> registry(shards_lock);
+      stats.shards = shards.size();
+      std::vector<Shard*> all(shards);
+      all.push_back(&retired);
+      for (auto s: all) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        stats.hits += s->hits;
+        stats.misses += s->misses;
+        stats.arena_hits += s->arena_hits;
+        stats.arena_misses += s->arena_misses;
+        for (auto& h: s->shapes) {
+          stats.shapes[{h.first >> 32, h.first & 0xffffffff}] += h.second;
+        }
+      }
+      stats.cached_bytes = cached_bytes;
+      stats.arena_bytes = arena_bytes;
+      stats.live_bytes = allocated_bytes - stats.cached_bytes - arena_bytes;
+      stats.peak_bytes = peak_bytes;
+      return stats;
+    }
+
+    // reset request counters, shape histogram and peak bytes
+    void reset_stats() {
+      std::lock_guard<std::mutex> registry(shards_lock);
+      std::vector<Shard*> all(shards);
+      all.push_back(&retired);
+      for (auto s: all) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->hits = s->misses = 0;
+        s->arena_hits = s->arena_misses = 0;
+        s->shapes.clear();
       }
-      it->second->push(matrix);
+      peak_bytes = allocated_bytes.load();
+    }
+
+    // enable per-shape request histogram
+    void set_histogram(bool enable) {
+      histogram = enable;
+    }
+
+    // print allocation statistics as JSON
+    void print_stats(std::ostream& out) {
+      get_stats().print(out);
     }
 
     // get matrix count
     std::size_t get_matrix_count() {
+      collect();
       std::size_t count = 0;
-      auto it = matrix_cache.begin();
-      while (it != matrix_cache.end()) {
-        count += it->second->size();
-        it++;
+      std::lock_guard<std::mutex> registry(shards_lock);
+      for (auto s: shards) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        for (auto& q: s->cache) {
+          count += q.size();
+        }
       }
       return count;
     }
 
-    // get matrix count
+    // get count of matrices that can serve the given shape
     std::size_t get_matrix_count(std::size_t rows, std::size_t cols) {
-      std::size_t h = pair_hash(rows, cols);
-      auto it = matrix_cache.find(h);
-      if (it == matrix_cache.end()) {
-        return 0;
-      } else {
-        return it->second->size();
+      collect();
+      std::size_t count = 0;
+      std::size_t c = size_class(rows * cols);
+      std::lock_guard<std::mutex> registry(shards_lock);
+      for (auto s: shards) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        if (c < s->cache.size()) {
+          count += s->cache[c].size();
+        }
+      }
+      return count;
+    }
+
+    // get bytes held by cached matrices
+    std::size_t get_cached_bytes() const {
+      return cached_bytes;
+    }
+
+    // set number of matrices per size a thread keeps before overflowing
+    void set_shard_limit(std::size_t limit) {
+      shard_limit = limit;
+    }
+
+    // set cache high-water mark in bytes, crossing it trims to 3/4 of it
+    void set_pool_limit(std::size_t limit) {
+      pool_limit = limit;
+      if (cached_bytes > pool_limit) {
+        trim(pool_limit - pool_limit / 4);
       }
     }
 
@@ -94,7 +395,16 @@ class Context {
     // matrix interface
     //
 
-    virtual M<T>* create(std::size_t rows, std::size_t cols) const = 0;
+    virtual M<T>*
+    create(std::size_t rows, std::size_t cols, std::size_t capacity) const = 0;
+
+    virtual std::size_t capacity(const M<T>& a) const = 0;
+    virtual void reshape(M<T>& a, std::size_t rows, std::size_t cols) const = 0;
+
+    // map default constructed matrix r onto region elements from offset,
+    // views own no storage and report zero capacity
+    virtual void view(M<T>& r, M<T>& region, std::size_t offset,
+    std::size_t rows, std::size_t cols) const = 0;
 
     virtual std::size_t rows(const M<T>& a) const = 0;
     virtual std::size_t cols(const M<T>& a) const = 0;
@@ -107,7 +417,21 @@ class Context {
     virtual void add(const M<T>& a, const M<T>& b, M<T>& r) const = 0;
     virtual void sub(const M<T>& a, const M<T>& b, M<T>& r) const = 0;
 
-    virtual void prod(const M<T>& a, const M<T>& b, M<T>& r) const = 0;
+    // in-place r += a, r -= a, r *= s and r += s * a
+    virtual void add(const M<T>& a, M<T>& r) const = 0;
+    virtual void sub(const M<T>& a, M<T>& r) const = 0;
+    virtual void scale(T s, M<T>& r) const = 0;
+    virtual void axpy(T s, const M<T>& a, M<T>& r) const = 0;
+
+    // r = a * b
+    void prod(const M<T>& a, const M<T>& b, M<T>& r) const {
+      gemm(false, false, 1, a, b, 0, r);
+    }
+
+    // r = alpha * op(a) * op(b) + beta * r, op transposes if ta or tb
+    virtual void gemm(bool ta, bool tb, T alpha,
+    const M<T>& a, const M<T>& b, T beta, M<T>& r) const = 0;
+
     virtual void mul(const M<T>& a, T b, M<T>& r) const = 0;
     virtual void mul(const M<T>& a, const M<T>& b, M<T>& r) const = 0;
 
@@ -116,6 +440,77 @@ class Context {
 
     virtual T summation(const M<T>& a) const = 0;
 
+    // r = op over each row of a into rows x 1 or over each column into
+    // 1 x cols, the default reduces a host copy of a
+    virtual void
+    reduce(ReduceOp op, ReduceAxis axis, const M<T>& a, M<T>& r) const {
+      std::size_t n = (axis == AXIS_ROWS) ? rows(a) : cols(a);
+      if (!reduce_shape(axis, a, r)) {
+        on_error("dimension mismatch in matrix reduction");
+        return;
+      }
+      std::vector<T> va, vr(n);
+      get(a, va);
+      Reducer<T>::reduce(op, axis, va.data(), rows(a), cols(a), cols(a),
+        vr.data());
+      set(r, vr);
+    }
+
+    // r = a op b with b of the shape of a, 1x1, 1 x cols or rows x 1
+    // repeated over the missing axes, the default works on host copies
+    virtual void
+    broadcast(BroadcastOp op, const M<T>& a, const M<T>& b, M<T>& r) const {
+      if (!broadcast_shape(a, b)) {
+        on_error("dimension mismatch in matrix broadcast");
+        return;
+      }
+      std::size_t n = rows(a), m = cols(a);
+      if (rows(b) == n && cols(b) == m) {
+        if (op == BROADCAST_ADD) {
+          add(a, b, r);
+        }
+        else if (op == BROADCAST_SUB) {
+          sub(a, b, r);
+        }
+        else {
+          mul(a, b, r);
+        }
+        return;
+      }
+      std::vector<T> va, vb;
+      get(b, vb);
+      if (op == BROADCAST_MUL && vb.size() == 1) {
+        mul(a, vb[0], r);
+        return;
+      }
+      get(a, va);
+      std::size_t rs = (rows(b) == 1) ? 0 : cols(b);
+      std::size_t cs = (cols(b) == 1) ? 0 : 1;
+      for (std::size_t i=0; i<n; i++) {
+        for (std::size_t j=0; j<m; j++) {
+          T x = vb[i * rs + j * cs];
+          T& y = va[i * m + j];
+          y = (op == BROADCAST_ADD) ? y + x :
+            (op == BROADCAST_SUB) ? y - x : y * x;
+        }
+      }
+      set(r, va);
+    }
+
+    // check b broadcasts to the shape of a
+    bool broadcast_shape(const M<T>& a, const M<T>& b) const {
+      return (rows(b) == rows(a) || rows(b) == 1) &&
+        (cols(b) == cols(a) || cols(b) == 1);
+    }
+
+    // check r shape of a reduction of a along axis
+    bool reduce_shape(ReduceAxis axis, const M<T>& a, const M<T>& r) const {
+      if (axis == AXIS_ROWS) {
+        return rows(r) == rows(a) && cols(r) == 1 && cols(a) > 0;
+      }
+      return rows(r) == 1 && cols(r) == cols(a) && rows(a) > 0;
+    }
+
     //
     // error handler
     //
@@ -133,13 +528,352 @@ class Context {
     }
 
   private:
+    // cached matrix with its release stamp
+    struct Entry {
+      std::size_t stamp;
+      M<T>* matrix;
+    };
+
+    // matrix cache indexed by size class, oldest entries first
+    typedef std::vector<std::deque<Entry>> Cache;
+
+    // per-thread step arena of views into one contiguous region
+    struct Arena {
+      Arena() : live(0) {
+        region = NULL;
+        views = NULL;
+        size = count = offset = used = demand = requests = depth = 0;
+        region_bytes = 0;
+      }
+
+      M<T>* region;     // contiguous storage
+      M<T>* views;      // view headers
+      std::size_t size;     // region elements
+      std::size_t region_bytes; // region bytes, kept for retire
+      std::size_t count;    // view header count
+      std::size_t offset;   // region elements in use
+      std::size_t used;     // view headers in use
+      std::size_t demand;   // region elements requested in the step
+      std::size_t requests; // view headers requested in the step
+      std::size_t depth;    // nested step count
+      std::atomic<std::size_t> live;  // views not yet released
+    };
+
+    // per-thread cache shard, the lock is only contended by introspection,
+    // the counters are only written by the owner thread
+    struct Shard {
+      Shard() : hits(0), misses(0), arena_hits(0), arena_misses(0) {}
+
+      std::mutex lock;
+      Cache cache;
+      Arena arena;
+
+      // request counters
+      std::atomic<std::size_t> hits;
+      std::atomic<std::size_t> misses;
+      std::atomic<std::size_t> arena_hits;
+      std::atomic<std::size_t> arena_misses;
+
+      // request histogram keyed by size hash
+      std::unordered_map<std::size_t, std::size_t> shapes;
+    };
+
+    // shards of the calling thread by context serial, handed back to
+    // their live contexts when the thread exits
+    struct Local {
+      Local() {
+        last_serial = 0;
+        last_shard = NULL;
+        auto& g = global();
+        std::lock_guard<std::mutex> guard(g.lock);
+        g.locals.insert(this);
+      }
+
+      ~Local() {
+        auto& g = global();
+        std::lock_guard<std::mutex> guard(g.lock);
+        g.locals.erase(this);
+        for (auto& e: shards) {
+          auto it = g.contexts.find(e.first);
+          if (it != g.contexts.end()) {
+            it->second->retire(e.second);
+          }
+        }
+      }
+
+      std::unordered_map<std::size_t, Shard*> shards;
+      std::size_t last_serial;
+      Shard* last_shard;
+    };
+
+    // live contexts and thread shard maps, a destroyed context erases
+    // itself from the maps of all threads
+    struct Global {
+      std::mutex lock;
+      std::unordered_map<std::size_t, Context*> contexts;
+      std::unordered_set<Local*> locals;
+    };
+
+    static Global& global() {
+      static Global g;
+      return g;
+    }
+
+    // overflow list node shared by all threads
+    struct Node {
+      M<T>* matrix;
+      Node* next;
+    };
+
     // get a hash of 2D matrix size
-    std::size_t pair_hash(std::size_t rows, std::size_t cols) {
+    static std::size_t pair_hash(std::size_t rows, std::size_t cols) {
       return (rows << 32) + cols;
     }
 
-    // matrix cache keyed by size hash
-    std::unordered_map<std::size_t, std::queue<M<T>*>*> matrix_cache;
+    // account newly allocated bytes and update the peak
+    void allocate(std::size_t size) {
+      std::size_t total = (allocated_bytes += size);
+      std::size_t peak = peak_bytes;
+      while (total > peak && !peak_bytes.compare_exchange_weak(peak, total));
+    }
+
+    // get size of matrix storage in bytes
+    std::size_t bytes(const M<T>& a) const {
+      return capacity(a) * element_bytes();
+    }
+
+    // get storage size of one element, a backend may store T in fewer bytes
+    virtual std::size_t element_bytes() const {
+      return sizeof(T);
+    }
+
+    // get element count of a size class, four classes per power of two:
+    // 1, 2, ..., 8, 10, 12, 14, 16, 20, 24, 28, 32, 40, ...
+    static std::size_t class_size(std::size_t c) {
+      if (c < 8) {
+        return c + 1;
+      }
+      return (5 + c % 4) << (c / 4 - 1);
+    }
+
+    // get smallest size class holding the element count
+    static std::size_t size_class(std::size_t n) {
+      if (n <= 8) {
+        return (n > 0) ? n - 1 : 0;
+      }
+      std::size_t k = 0;
+      while ((std::size_t(8) << k) < n) {
+        k++;
+      }
+      std::size_t step = std::size_t(1) << k;
+      return 4 * (k + 1) + (n + step - 1) / step - 5;
+    }
+
+    // get largest size class fitting in the element count
+    static std::size_t floor_class(std::size_t n) {
+      std::size_t c = size_class(n);
+      return (c > 0 && class_size(c) > n) ? c - 1 : c;
+    }
+
+    // get unique context serial, never reused by later contexts
+    static std::size_t next_serial() {
+      static std::atomic<std::size_t> counter(0);
+      return ++counter;
+    }
+
+    // get cache shard of the calling thread, register one if needed
+    Shard& shard() {
+      static thread_local Local local;
+      if (local.last_serial == serial) {
+        return *local.last_shard;
+      }
+
+      Shard* s;
+      {
+        auto& g = global();
+        std::lock_guard<std::mutex> guard(g.lock);
+        auto it = local.shards.find(serial);
+        if (it == local.shards.end()) {
+          s = new Shard();
+          std::lock_guard<std::mutex> registry(shards_lock);
+          shards.push_back(s);
+          it = local.shards.insert({serial, s}).first;
+        }
+        s = it->second;
+      }
+
+      local.last_serial = serial;
+      local.last_shard = s;
+      return *s;
+    }
+
+    // hand back the shard of an exiting thread, its cached matrices go to
+    // the overflow list and its counters to the retired totals; a shard
+    // with arena views still in use stays until the context is destroyed;
+    // no virtuals are called as the derived context may be destroyed
+    void retire(Shard* s) {
+      if (s->arena.live > 0) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> registry(shards_lock);
+        shards.erase(std::find(shards.begin(), shards.end(), s));
+        std::lock_guard<std::mutex> guard(retired.lock);
+        retired.hits += s->hits;
+        retired.misses += s->misses;
+        retired.arena_hits += s->arena_hits;
+        retired.arena_misses += s->arena_misses;
+        for (auto& h: s->shapes) {
+          retired.shapes[h.first] += h.second;
+        }
+      }
+      for (auto& q: s->cache) {
+        for (auto& e: q) {
+          push(e.matrix);
+        }
+      }
+      allocated_bytes -= s->arena.region_bytes;
+      arena_bytes -= s->arena.region_bytes;
+      delete s->arena.region;
+      delete[] s->arena.views;
+      delete s;
+    }
+
+    // bump allocate a view from the arena, NULL if it does not fit
+    M<T>* bump(Arena& a, std::size_t rows, std::size_t cols) {
+      std::size_t n = align_size(rows * cols);
+      a.demand += n;
+      a.requests++;
+      if (a.offset + n > a.size || a.used >= a.count) {
+        return NULL;
+      }
+      auto m = &a.views[a.used++];
+      view(*m, *a.region, a.offset, rows, cols);
+      a.offset += n;
+      a.live++;
+      return m;
+    }
+
+    // check if view header belongs to the arena
+    static bool owns(const Arena& a, const M<T>* m) {
+      std::less<const M<T>*> less;
+      return !less(m, a.views) && less(m, a.views + a.count);
+    }
+
+    // release arena view, possibly on another thread than its owner,
+    // or delete a standalone view; the view headers of a shard are only
+    // replaced by its owner under the shard lock
+    void release(M<T>* matrix) {
+      auto& a = shard().arena;
+      if (owns(a, matrix)) {
+        a.live--;
+        return;
+      }
+      std::lock_guard<std::mutex> registry(shards_lock);
+      for (auto s: shards) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        if (owns(s->arena, matrix)) {
+          s->arena.live--;
+          return;
+        }
+      }
+      delete matrix;
+    }
+
+    // get cache slot of the size class
+    std::deque<Entry>& slot(Cache& cache, std::size_t c) {
+      if (c >= cache.size()) {
+        cache.resize(c + 1);
+      }
+      return cache[c];
+    }
+
+    // pop most recently cached matrix of the size class
+    M<T>* pop(Cache& cache, std::size_t c) {
+      if (c < cache.size() && cache[c].size() > 0) {
+        auto top = cache[c].back().matrix;
+        cache[c].pop_back();
+        return top;
+      }
+      return NULL;
+    }
+
+    // push matrix to the lock-free overflow list
+    void push(M<T>* matrix) {
+      auto node = new Node();
+      node->matrix = matrix;
+      node->next = overflow.load(std::memory_order_relaxed);
+      while (!overflow.compare_exchange_weak(node->next, node,
+      std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // move the whole overflow list to cache, return true if not empty
+    bool drain(Cache& cache) {
+      auto node = overflow.exchange(NULL, std::memory_order_acquire);
+      bool drained = (node != NULL);
+      while (node != NULL) {
+        auto next = node->next;
+        auto c = floor_class(capacity(*node->matrix));
+        slot(cache, c).push_back({tick++, node->matrix});
+        delete node;
+        node = next;
+      }
+      return drained;
+    }
+
+    // move overflow to the calling thread shard
+    void collect() {
+      auto& s = shard();
+      std::lock_guard<std::mutex> guard(s.lock);
+      drain(s.cache);
+    }
+
+    // delete cached matrices
+    void clear(Cache& cache) {
+      for (auto& q: cache) {
+        for (auto& e: q) {
+          delete e.matrix;
+        }
+      }
+      cache.clear();
+    }
+
+    // context serial for thread local shard lookup
+    std::size_t serial;
+
+    // cache shards of all threads
+    std::vector<Shard*> shards;
+    std::mutex shards_lock;
+
+    // counters of the shards of exited threads
+    Shard retired;
+
+    // overflow list of matrices beyond shard limit
+    std::atomic<Node*> overflow;
+
+    // max matrices of one size class in a shard
+    std::size_t shard_limit;
+
+    // cache high-water mark in bytes
+    std::size_t pool_limit;
+
+    // bytes held by cached matrices
+    std::atomic<std::size_t> cached_bytes;
+
+    // bytes held by all matrices and arenas
+    std::atomic<std::size_t> allocated_bytes;
+
+    // bytes held by step arenas
+    std::atomic<std::size_t> arena_bytes;
+
+    // peak of allocated bytes
+    std::atomic<std::size_t> peak_bytes;
+
+    // collect per-shape request histogram
+    bool histogram;
+
+    // release clock for least recently cached trimming
+    std::atomic<std::size_t> tick;
 
     // invalid argument handler
     void (*error_handler)(const char* msg);
@@ -3,19 +3,215 @@
 
 #include <eigen3/Eigen/Dense>
 
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+
+#include "fixed.hh"
 #include "matrix.hh"
+#include "simd.hh"
 
 // CPU implementation with Eigen
 
-template<typename T> using CPUMatrix = Eigen::Matrix
-<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+// page backing of CPU matrix buffers
+enum CPUPages {
+  PAGES_DEFAULT,      // regular pages
+  PAGES_TRANSPARENT,  // transparent huge pages via madvise
+  PAGES_HUGETLB,      // hugetlb pool via mmap, regular pages if exhausted
+};
+
+// CPU matrix buffer allocation policy
+struct CPUAllocator {
+  CPUAllocator() {
+    alignment = 64;
+    pages = PAGES_DEFAULT;
+    threshold = HUGE_PAGE;
+  }
+
+  // allocate bytes, set mapped to the mmap length or 0 if heap allocated
+  void* allocate(std::size_t bytes, std::size_t& mapped) const {
+    mapped = 0;
+    bool huge = (pages != PAGES_DEFAULT && bytes >= threshold);
+#ifdef MAP_HUGETLB
+    if (huge && pages == PAGES_HUGETLB) {
+      std::size_t length = (bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+      void* p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (p != MAP_FAILED) {
+        mapped = length;
+        return p;
+      }
+    }
+#endif
+    void* p = NULL;
+    std::size_t align = alignment;
+    if (huge) {
+      align = HUGE_PAGE;
+    }
+    if (posix_memalign(&p, align, bytes) != 0) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+      madvise(p, bytes, MADV_HUGEPAGE);
+    }
+#endif
+    return p;
+  }
+
+  // release allocated bytes
+  static void deallocate(void* p, std::size_t mapped) {
+    if (mapped > 0) {
+      munmap(p, mapped);
+    }
+    else {
+      std::free(p);
+    }
+  }
+
+  static const std::size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+  std::size_t alignment;  // buffer alignment in bytes, at least 64
+  CPUPages pages;         // huge page backing
+  std::size_t threshold;  // smallest buffer in bytes backed by huge pages
+};
+
+// buffers are aligned but views of batch samples start anywhere in them,
+// so the map claims no alignment and Eigen finds it at run time
+template<typename T> using CPUMatrixMap = Eigen::Map<Eigen::Matrix
+<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>, Eigen::Unaligned>;
+
+// Eigen matrix map over an owned buffer with room for capacity elements,
+// so that one buffer can be reshaped to any shape that fits in it,
+// a default constructed matrix is an empty view owning no storage
+template<typename T>
+class CPUMatrix : public CPUMatrixMap<T> {
+  public:
+    typedef CPUMatrixMap<T> Base;
+
+    CPUMatrix() : Base(NULL, 0, 0) {
+      _capacity = 0;
+      _mapped = 0;
+    }
+
+    CPUMatrix(std::size_t rows, std::size_t cols, std::size_t capacity,
+    const CPUAllocator& allocator) : Base(NULL, 0, 0) {
+      _capacity = capacity;
+      _mapped = 0;
+      T* data = NULL;
+      if (capacity > 0) {
+        data = static_cast<T*>(
+          allocator.allocate(sizeof(T) * capacity, _mapped));
+      }
+      rebind(data, rows, cols);
+    }
+
+    // view of external storage, owning no buffer
+    CPUMatrix(T* data, std::size_t rows, std::size_t cols) :
+    Base(data, rows, cols) {
+      _capacity = 0;
+      _mapped = 0;
+    }
+
+    CPUMatrix(const CPUMatrix& m) = delete;
+
+    ~CPUMatrix() {
+      if (_capacity > 0) {
+        CPUAllocator::deallocate(this->data(), _mapped);
+      }
+    }
+
+    // copy values of the same shape
+    CPUMatrix& operator=(const CPUMatrix& m) {
+      Base::operator=(m);
+      return *this;
+    }
+
+    using Base::operator=;
+
+    // element capacity of the buffer
+    std::size_t capacity() const {
+      return _capacity;
+    }
+
+    // remap the buffer to a new shape within capacity
+    void reshape(std::size_t rows, std::size_t cols) {
+      rebind(this->data(), rows, cols);
+    }
+
+    // remap a view to external storage
+    void rebind(T* data, std::size_t rows, std::size_t cols) {
+      new (static_cast<Base*>(this)) Base(data, rows, cols);
+    }
+
+  private:
+    std::size_t _capacity;
+    std::size_t _mapped;
+};
+
+// element-wise expressions are fused into single Eigen expressions
+template<>
+struct FusedExpressions<CPUMatrix> : std::true_type {};
 
 template<typename T>
 class CPUContext : public Context<T, CPUMatrix> {
   public:
+    // set buffer alignment in bytes, a power of two of at least 64
+    void set_alignment(std::size_t alignment) {
+      if (alignment >= 64 && (alignment & (alignment - 1)) == 0) {
+        _allocator.alignment = alignment;
+      }
+      else {
+        this->on_error("alignment not a power of two of at least 64");
+      }
+    }
+
+    // back buffers of at least threshold bytes with huge pages
+    void set_pages(CPUPages pages,
+    std::size_t threshold = CPUAllocator::HUGE_PAGE) {
+      _allocator.pages = pages;
+      _allocator.threshold = threshold;
+    }
+
+    // limit element-wise kernels to an instruction set, SIMD_NONE uses Eigen
+    void set_simd(SIMDLevel max) {
+      _simd = SIMD<T>::get(max);
+    }
+
+    // instruction set of the element-wise kernels
+    SIMDLevel get_simd() const {
+      return _simd.level;
+    }
+
+    // use fixed-size kernels for small matrix-vector and outer products
+    void set_fixed(bool fixed) {
+      _fixed = fixed;
+    }
+
     CPUMatrix<T>*
-    create(std::size_t rows, std::size_t cols) const {
-      return new CPUMatrix<T>(rows, cols);
+    create(std::size_t rows, std::size_t cols, std::size_t capacity) const {
+      return new CPUMatrix<T>(rows, cols, capacity, _allocator);
+    }
+
+    std::size_t
+    capacity(const CPUMatrix<T>& a) const {
+      return a.capacity();
+    }
+
+    void
+    reshape(CPUMatrix<T>& a, std::size_t rows, std::size_t cols) const {
+      if (rows * cols <= a.capacity()) {
+        a.reshape(rows, cols);
+      }
+      else {
+        this->on_error("matrix reshape exceeds capacity");
+      }
+    }
+
+    void
+    view(CPUMatrix<T>& r, CPUMatrix<T>& region, std::size_t offset,
+    std::size_t rows, std::size_t cols) const {
+      r.rebind(region.data() + offset, rows, cols);
     }
 
     std::size_t
@@ -50,32 +246,94 @@ class CPUContext : public Context<T, CPUMatrix> {
 
     void
     add(const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
-      if (a.rows() == b.rows() && a.cols() == b.cols()) {
-        r.noalias() = a + b;
+      if (a.rows() != b.rows() || a.cols() != b.cols()) {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+      else if (_simd.add && same(a, r)) {
+        _simd.add(a.data(), b.data(), r.data(), a.size());
       }
       else {
-        this->on_error("dimension mismatch in matrix addition");
+        r.noalias() = a + b;
       }
     }
 
     void
     sub(const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
-      if (a.rows() == b.rows() && a.cols() == b.cols()) {
+      if (a.rows() != b.rows() || a.cols() != b.cols()) {
+        this->on_error("dimension mismatch in matrix subtracion");
+      }
+      else if (_simd.sub && same(a, r)) {
+        _simd.sub(a.data(), b.data(), r.data(), a.size());
+      }
+      else {
         r.noalias() = a - b;
       }
+    }
+
+    void
+    add(const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (a.rows() != r.rows() || a.cols() != r.cols()) {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+      else if (_simd.add) {
+        _simd.add(r.data(), a.data(), r.data(), r.size());
+      }
       else {
+        r += a;
+      }
+    }
+
+    void
+    sub(const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (a.rows() != r.rows() || a.cols() != r.cols()) {
         this->on_error("dimension mismatch in matrix subtracion");
       }
+      else if (_simd.sub) {
+        _simd.sub(r.data(), a.data(), r.data(), r.size());
+      }
+      else {
+        r -= a;
+      }
     }
 
     void
-    prod(const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
-      if (a.cols() == b.rows()) {
-        r.noalias() = a * b;
+    scale(T s, CPUMatrix<T>& r) const {
+      r *= s;
+    }
+
+    void
+    axpy(T s, const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (a.rows() == r.rows() && a.cols() == r.cols()) {
+        r += s * a;
       }
       else {
+        this->on_error("dimension mismatch in matrix axpy");
+      }
+    }
+
+    void
+    gemm(bool ta, bool tb, T alpha,
+    const CPUMatrix<T>& a, const CPUMatrix<T>& b, T beta,
+    CPUMatrix<T>& r) const {
+      typename Fixed<T>::Kernel kernel = fixed(ta, a, r);
+      if (!gemm_shape(ta, tb, a, b, r)) {
         this->on_error("dimension mismatch in matrix-product multiplication");
       }
+      else if (kernel) {
+        kernel(a.data(), b.data(), alpha, beta, r.data());
+      }
+      else if (ta && tb) {
+        product(a.transpose(), b.transpose(), alpha, beta, r);
+      }
+      else if (ta) {
+        product(a.transpose(), b, alpha, beta, r);
+      }
+      else if (tb) {
+        product(a, b.transpose(), alpha, beta, r);
+      }
+      else {
+        product(a, b, alpha, beta, r);
+      }
     }
 
     void
@@ -86,17 +344,25 @@ class CPUContext : public Context<T, CPUMatrix> {
     void
     mul(
     const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
-      if (a.cols() == b.cols() && a.rows() == b.rows()) {
-        r = a.array() * b.array();
+      if (a.cols() != b.cols() || a.rows() != b.rows()) {
+        this->on_error("dimension mismatch in matrix-element multiplication");
+      }
+      else if (_simd.mul && same(a, r)) {
+        _simd.mul(a.data(), b.data(), r.data(), a.size());
       }
       else {
-        this->on_error("dimension mismatch in matrix-element multiplication");
+        r = a.array() * b.array();
       }
     }
 
     void
     exponent(const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
-      r.noalias() = a.array().exp().matrix();
+      if (_simd.exp && same(a, r)) {
+        _simd.exp(a.data(), r.data(), a.size());
+      }
+      else {
+        r.noalias() = a.array().exp().matrix();
+      }
     }
 
     void
@@ -104,10 +370,130 @@ class CPUContext : public Context<T, CPUMatrix> {
       r.noalias() = a.transpose();
     }
 
+    // pairwise over the leaves of the row reductions, the vector kernel
+    // sums one leaf
     T
     summation(const CPUMatrix<T>& a) const {
-      return a.array().sum();
+      const T* x = a.data();
+      if (_simd.sum) {
+        return Reducer<T>::pairwise(0, a.size(), Reducer<T>::BLOCK,
+        [&](std::size_t lo, std::size_t n) {
+          return _simd.sum(x + lo, n);
+        });
+      }
+      return Reducer<T>::row(REDUCE_SUM, x, a.size());
+    }
+
+    // a 1x1 b runs as a scalar op, rows and columns repeat in place
+    void
+    broadcast(BroadcastOp op, const CPUMatrix<T>& a, const CPUMatrix<T>& b,
+    CPUMatrix<T>& r) const {
+      if (!this->broadcast_shape(a, b) ||
+      r.rows() != a.rows() || r.cols() != a.cols()) {
+        this->on_error("dimension mismatch in matrix broadcast");
+      }
+      else if (b.rows() == a.rows() && b.cols() == a.cols()) {
+        if (op == BROADCAST_ADD) {
+          add(a, b, r);
+        }
+        else if (op == BROADCAST_SUB) {
+          sub(a, b, r);
+        }
+        else {
+          mul(a, b, r);
+        }
+      }
+      else if (b.size() == 1) {
+        T s = b(0, 0);
+        if (op == BROADCAST_MUL) {
+          mul(a, s, r);
+        }
+        else {
+          r.array() = a.array() + ((op == BROADCAST_ADD) ? s : -s);
+        }
+      }
+      else if (b.rows() == 1) {
+        if (op == BROADCAST_ADD) {
+          r.array() = a.array().rowwise() + b.row(0).array();
+        }
+        else if (op == BROADCAST_SUB) {
+          r.array() = a.array().rowwise() - b.row(0).array();
+        }
+        else {
+          r.array() = a.array().rowwise() * b.row(0).array();
+        }
+      }
+      else {
+        if (op == BROADCAST_ADD) {
+          r.array() = a.array().colwise() + b.col(0).array();
+        }
+        else if (op == BROADCAST_SUB) {
+          r.array() = a.array().colwise() - b.col(0).array();
+        }
+        else {
+          r.array() = a.array().colwise() * b.col(0).array();
+        }
+      }
     }
+
+    void
+    reduce(ReduceOp op, ReduceAxis axis, const CPUMatrix<T>& a,
+    CPUMatrix<T>& r) const {
+      if (this->reduce_shape(axis, a, r)) {
+        Reducer<T>::reduce(op, axis, a.data(), a.rows(), a.cols(), a.cols(),
+          r.data());
+      }
+      else {
+        this->on_error("dimension mismatch in matrix reduction");
+      }
+    }
+
+  protected:
+    // check a and r dimensions, the vector kernels write a.size() elements
+    // into r and leave mismatched shapes to the checks of Eigen
+    static bool same(const CPUMatrix<T>& a, const CPUMatrix<T>& r) {
+      return r.rows() == a.rows() && r.cols() == a.cols();
+    }
+
+    // check r = op(a) * op(b) dimensions
+    static bool gemm_shape(bool ta, bool tb,
+    const CPUMatrix<T>& a, const CPUMatrix<T>& b, const CPUMatrix<T>& r) {
+      return (ta ? a.rows() : a.cols()) == (tb ? b.cols() : b.rows()) &&
+        r.rows() == (ta ? a.cols() : a.rows()) &&
+        r.cols() == (tb ? b.rows() : b.cols());
+    }
+
+    // fixed-size kernel of a product into r, NULL if there is none
+    typename Fixed<T>::Kernel
+    fixed(bool ta, const CPUMatrix<T>& a, const CPUMatrix<T>& r) const {
+      if (!_fixed) {
+        return NULL;
+      }
+      return Fixed<T>::find(ta, r.rows(), ta ? a.rows() : a.cols(), r.cols());
+    }
+
+    // r = alpha * a * b + beta * r for plain or transposed operands
+    template <typename A, typename B, typename R>
+    static void
+    product(const A& a, const B& b, T alpha, T beta, R& r) {
+      if (beta == 0) {
+        r.noalias() = alpha * a * b;
+      }
+      else {
+        if (beta != 1) {
+          r *= beta;
+        }
+        r.noalias() += alpha * a * b;
+      }
+    }
+
+  private:
+    // buffer allocation policy
+    CPUAllocator _allocator;
+
+    // element-wise kernels for the host instruction set
+    SIMD<T> _simd = SIMD<T>::get();
+    bool _fixed = true;
 };
 
 #endif /*_DL_MATRIX_H_*/
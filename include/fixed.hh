@@ -0,0 +1,112 @@
+#ifndef _DL_FIXED_H_
+#define _DL_FIXED_H_
+
+#include <eigen3/Eigen/Dense>
+
+#include <type_traits>
+
+// Fixed-size CPU product kernels for small vector shapes
+
+// kernels of products with small sides known at compile time, Eigen
+// unrolls and vectorizes them with no size checks or blocking
+template <typename T>
+struct Fixed {
+  // r = alpha * op(a) * op(b) + beta * r over row major buffers
+  typedef void (*Kernel)(const T* a, const T* b, T alpha, T beta, T* r);
+
+  // r(M) = op(a)(M x K) * b(K), a transposed a is stored K x M
+  template <int M, int K, bool TA>
+  static void gemv(const T* a, const T* b, T alpha, T beta, T* r) {
+    typedef Eigen::Matrix<T, M, K, TA ? Eigen::ColMajor : Eigen::RowMajor> A;
+    Eigen::Map<const A> ma(a);
+    Eigen::Map<const Eigen::Matrix<T, K, 1>> mb(b);
+    Eigen::Map<Eigen::Matrix<T, M, 1>> mr(r);
+    update(product(ma, mb, std::integral_constant<bool, TA>()),
+      alpha, beta, mr);
+  }
+
+  // r(M x N) = a(M) * b(N)^T, a and b are vectors either way round
+  template <int M, int N>
+  static void outer(const T* a, const T* b, T alpha, T beta, T* r) {
+    Eigen::Map<const Eigen::Matrix<T, M, 1>> ma(a);
+    Eigen::Map<const Eigen::Matrix<T, 1, N>> mb(b);
+    Eigen::Map<Eigen::Matrix<T, M, N, Eigen::RowMajor>> mr(r);
+    update(ma * mb, alpha, beta, mr);
+  }
+
+  // kernel of an M x K by K x N product, NULL if none is compiled in
+  static Kernel find(bool ta, std::size_t m, std::size_t k, std::size_t n) {
+#define DL_FIXED_GEMV(TA, M) \
+    { gemv<M, 8, TA>, gemv<M, 16, TA>, gemv<M, 32, TA>, gemv<M, 64, TA> }
+#define DL_FIXED_OUTER(M) \
+    { outer<M, 8>, outer<M, 16>, outer<M, 32>, outer<M, 64> }
+    static const Kernel gemvs[2][SIDES][SIDES] = {
+      { DL_FIXED_GEMV(false, 8), DL_FIXED_GEMV(false, 16),
+        DL_FIXED_GEMV(false, 32), DL_FIXED_GEMV(false, 64) },
+      { DL_FIXED_GEMV(true, 8), DL_FIXED_GEMV(true, 16),
+        DL_FIXED_GEMV(true, 32), DL_FIXED_GEMV(true, 64) },
+    };
+    static const Kernel outers[SIDES][SIDES] = {
+      DL_FIXED_OUTER(8), DL_FIXED_OUTER(16),
+      DL_FIXED_OUTER(32), DL_FIXED_OUTER(64),
+    };
+#undef DL_FIXED_GEMV
+#undef DL_FIXED_OUTER
+
+    int sm = side(m);
+    if (sm < 0) {
+      return NULL;
+    }
+    if (n == 1 && side(k) >= 0) {
+      return gemvs[ta][sm][side(k)];
+    }
+    if (k == 1 && side(n) >= 0) {
+      return outers[sm][side(n)];
+    }
+    return NULL;
+  }
+
+  // number of sides with kernels, 8 to 64 in powers of two
+  static const int SIDES = 4;
+
+  // kernel index of a side, -1 if there is none
+  static int side(std::size_t n) {
+    switch (n) {
+      case 8: return 0;
+      case 16: return 1;
+      case 32: return 2;
+      case 64: return 3;
+      default: return -1;
+    }
+  }
+
+  // a row major a multiplies as dot products of its contiguous rows,
+  // unrolled in place of the GEMV kernel of Eigen
+  template <typename A, typename B>
+  static auto product(const A& a, const B& b, std::false_type) ->
+  decltype(a.lazyProduct(b)) {
+    return a.lazyProduct(b);
+  }
+
+  template <typename A, typename B>
+  static auto product(const A& a, const B& b, std::true_type) ->
+  decltype(a * b) {
+    return a * b;
+  }
+
+  // r = alpha * p + beta * r
+  template <typename P, typename R>
+  static void update(const P& p, T alpha, T beta, R& r) {
+    if (beta == 0) {
+      r.noalias() = alpha * p;
+    }
+    else {
+      if (beta != 1) {
+        r *= beta;
+      }
+      r.noalias() += alpha * p;
+    }
+  }
+};
+
+#endif /*_DL_FIXED_H_*/
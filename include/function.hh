@@ -1,6 +1,8 @@
 #ifndef _DL_FUNCTION_H_
 #define _DL_FUNCTION_H_
 
+#include <mutex>
+
 #include "matrix.hh"
 
 template<typename T, template <typename> class M>
@@ -9,17 +11,111 @@ class Function {
     Function() {
       _cache = false;
       _value = NULL;
+      _gradient = NULL;
+      _deferred = false;
+      _pending = false;
+      _version = 0;
     }
 
-    virtual ~Function() { delete _value; }
+    virtual ~Function() {
+      delete _value;
+      delete _gradient;
+    }
 
     virtual const Matrix<T,M>& forward() = 0;
-    virtual void backward(const Matrix<T,M>& d) = 0;
-    virtual void refresh(bool deep) { _cache = false; }
+    // a refreshed function also drops a gradient it has not propagated
+    virtual void refresh(bool deep) {
+      _cache = false;
+      _pending = false;
+    }
+
+    // sum d into the gradient of a deferred function, otherwise
+    // propagate d to the inputs at once
+    virtual void backward(const Matrix<T,M>& d) {
+      if (_deferred) {
+        accumulate(d);
+      }
+      else {
+        propagate(d);
+      }
+    }
+
+    // propagate d to the inputs
+    virtual void propagate(const Matrix<T,M>& d) {}
+
+    // defer backward to a reverse pass, gradients from all consumers are
+    // summed first and propagated once by flush()
+    void set_deferred(bool deferred) {
+      _deferred = deferred;
+    }
+
+    // propagate the summed gradient if there is one, a step of a reverse
+    // pass run after all consumers of the function
+    void flush() {
+      if (_pending) {
+        _pending = false;
+        propagate(*_gradient);
+      }
+    }
+
+    // drop a gradient not yet propagated, the value is about to change
+    void discard() {
+      _pending = false;
+    }
+
+    // compute the value from inputs that are already computed, a step of
+    // a flat execution plan
+    virtual void evaluate() { forward(); }
+
+    // count of value changes, consumers compare it to the count they saw
+    // at their last evaluation to find stale inputs
+    virtual std::size_t version() const { return _version; }
+
+    // replace value buffer, takes ownership
+    void set_value(Matrix<T,M>* value) {
+      delete _value;
+      _value = value;
+      _cache = false;
+    }
+
+    // drop the value and the gradient buffer once the gradient is
+    // propagated, the next forward recomputes the value
+    virtual void release() {
+      set_value(NULL);
+      if (!_pending) {
+        delete _gradient;
+        _gradient = NULL;
+      }
+    }
 
   protected:
+    // sum d into the gradient, consumers may run on several threads
+    void accumulate(const Matrix<T,M>& d) {
+      std::lock_guard<std::mutex> guard(_lock);
+      if (_gradient == NULL) {
+        _gradient = new Matrix<T,M>(d.context(), d.rows(), d.cols(),
+          d.batch(), true);
+      }
+      if (_pending) {
+        *_gradient += d;
+      }
+      else {
+        *_gradient = d;
+        _pending = true;
+      }
+    }
+
     bool _cache;
     Matrix<T,M>* _value;
+
+    // summed gradient of a deferred function
+    Matrix<T,M>* _gradient;
+    bool _deferred;
+    bool _pending;
+    std::mutex _lock;
+
+    // value change count
+    std::size_t _version;
 };
 
 template<typename T, template <typename> class M>
@@ -36,20 +132,30 @@ class Variable : public Function<T,M>  {
       return value();
     }
 
+    // a batched d of an unbatched value adds up over the batch
     void backward(const Matrix<T,M>& d) {
+      std::lock_guard<std::mutex> guard(this->_lock);
       if (_derivative == NULL) {
-        _derivative = new Matrix<T,M>(d.context(), d.rows(), d.cols());
+        _derivative = new Matrix<T,M>(d.context(), d.rows(), d.cols(),
+          batch(d), true);
         _derivative->set(0);
       }
-      *_derivative = *_derivative + d;
+      *_derivative += d;
     }
 
     Matrix<T,M>* set(Matrix<T,M>* value) {
       auto prev = this->_value;
       this->_value = value;
+      touch();
       return prev;
     }
 
+    // mark the value changed after it is written in place, runtimes then
+    // recompute only the steps that depend on it
+    void touch() {
+      this->_version++;
+    }
+
     Matrix<T,M>& value() {
       if (this->_value != NULL) {
         return *this->_value;
@@ -69,6 +175,11 @@ class Variable : public Function<T,M>  {
     }
 
   protected:
+    // batch of the derivative, the batch of the value if there is one
+    int batch(const Matrix<T,M>& d) const {
+      return (this->_value != NULL) ? this->_value->batch() : d.batch();
+    }
+
     Matrix<T,M>* _derivative;
 };
 
@@ -78,8 +189,10 @@ class Constant : public Variable<T,M>  {
     Constant(Matrix<T,M>* value = NULL) : Variable<T,M> (value) {}
 
     void backward(const Matrix<T,M>& d) {
+      std::lock_guard<std::mutex> guard(this->_lock);
       if (this->_derivative == NULL) {
-        this->_derivative = new Matrix<T,M>(d.context(), d.rows(), d.cols());
+        this->_derivative = new Matrix<T,M>(d.context(), d.rows(), d.cols(),
+          this->batch(d), true);
         this->_derivative->set(0);
       }
     }
@@ -91,17 +204,22 @@ class UnaryOperator : public Function<T,M>  {
     UnaryOperator(Function<T,M>* f) { _function = f; }
 
     const Matrix<T,M>& forward() {
-      if (this->_value == NULL) {
-        this->_value = new Matrix<T,M>(compute());
-      }
-      else
       if (this->_cache == false) {
-        *this->_value = compute();
+        evaluate();
       }
-      this->_cache = true;
       return *this->_value;
     }
 
+    void evaluate() {
+      if (this->_value == NULL) {
+        auto& ctx = _function->forward().context();
+        this->_value = new Matrix<T,M>(ctx, 1, 1, true);
+      }
+      compute_into(*this->_value);
+      this->_cache = true;
+      this->_version++;
+    }
+
     void refresh(bool deep) {
       Function<T,M>::refresh(deep);
       if (deep) {
@@ -109,7 +227,8 @@ class UnaryOperator : public Function<T,M>  {
       }
     }
 
-    virtual Matrix<T,M> compute() = 0;
+    // compute the value into out, resizing out if needed
+    virtual void compute_into(Matrix<T,M>& out) = 0;
 
   protected:
     Function<T,M>* _function;
@@ -124,17 +243,22 @@ class BinaryOperator : public Function<T,M>  {
     }
 
     const Matrix<T,M>& forward() {
-      if (this->_value == NULL) {
-        this->_value = new Matrix<T,M>(compute());
-      }
-      else
       if (this->_cache == false) {
-        *this->_value = compute();
+        evaluate();
       }
-      this->_cache = true;
       return *this->_value;
     }
 
+    void evaluate() {
+      if (this->_value == NULL) {
+        auto& ctx = _lfunction->forward().context();
+        this->_value = new Matrix<T,M>(ctx, 1, 1, true);
+      }
+      compute_into(*this->_value);
+      this->_cache = true;
+      this->_version++;
+    }
+
     void refresh(bool deep) {
       Function<T,M>::refresh(deep);
       if (deep) {
@@ -143,9 +267,56 @@ class BinaryOperator : public Function<T,M>  {
       }
     }
 
-    virtual Matrix<T,M> compute() = 0;
+    // compute the value into out, resizing out if needed
+    virtual void compute_into(Matrix<T,M>& out) = 0;
 
   protected:
+    // check the operands have one shape and need no broadcast
+    static bool same(const Matrix<T,M>& l, const Matrix<T,M>& r) {
+      return l.rows() == r.rows() && l.cols() == r.cols() &&
+        l.batch() == r.batch();
+    }
+
+    // check l broadcasts r rather than the other way round
+    static bool spans(const Matrix<T,M>& l, const Matrix<T,M>& r) {
+      return l.rows() >= r.rows() && l.cols() >= r.cols();
+    }
+
+    // pass d to f summed over the axes its value x is broadcast along
+    static void backward_to(Function<T,M>* f, const Matrix<T,M>& x,
+    const Matrix<T,M>& d) {
+      if (x.rows() == d.rows() && x.cols() == d.cols()) {
+        f->backward(d);
+        return;
+      }
+      Matrix<T,M> g(d.context(), 1, 1, d.batch(), false);
+      if (x.rows() == 1 && x.cols() == 1) {
+        d.sums(g);
+      }
+      else if (x.rows() == 1) {
+        d.reduce(REDUCE_SUM, AXIS_COLS, g);
+      }
+      else {
+        d.reduce(REDUCE_SUM, AXIS_ROWS, g);
+      }
+      f->backward(g);
+    }
+
+    // pass d * y to f, a 1x1 x takes the inner product of d and y without
+    // an element-wise product
+    static void backward_to(Function<T,M>* f, const Matrix<T,M>& x,
+    const Matrix<T,M>& y, const Matrix<T,M>& d) {
+      if (x.rows() == 1 && x.cols() == 1 && y.rows() == d.rows() &&
+      y.cols() == d.cols() && (d.rows() > 1 || d.cols() > 1)) {
+        Matrix<T,M> g(d.context(), 1, 1, d.batch(), false);
+        d.dots(y, g);
+        f->backward(g);
+      }
+      else {
+        backward_to(f, x, Matrix<T,M>(d & y));
+      }
+    }
+
     Function<T,M>* _lfunction;
     Function<T,M>* _rfunction;
 };
@@ -156,12 +327,12 @@ class Exponent : public UnaryOperator<T,M> {
     Exponent(Function<T,M>* f) : UnaryOperator<T,M>(f) {}
 
     // f(a) = exp(a)
-    Matrix<T,M> compute() {
-      return this->_function->forward().E();
+    void compute_into(Matrix<T,M>& out) {
+      this->_function->forward().exponent(out);
     }
 
     // dE/da = dE/df * df/da = d * exp(a)
-    void backward(const Matrix<T,M>& d) {
+    void propagate(const Matrix<T,M>& d) {
       this->_function->backward(d & *this->_value);
     }
 };
@@ -172,12 +343,12 @@ class Transpose : public UnaryOperator<T,M> {
     Transpose(Function<T,M>* f) : UnaryOperator<T,M>(f) {}
 
     // f(a) = T(a)
-    Matrix<T,M> compute() {
-      return this->_function->forward().T();
+    void compute_into(Matrix<T,M>& out) {
+      this->_function->forward().transpose(out);
     }
 
     // dE/da = dE/df * df/da = d * I
-    void backward(const Matrix<T,M>& d) {
+    void propagate(const Matrix<T,M>& d) {
       this->_function->backward(d.T());
     }
 };
@@ -187,21 +358,65 @@ class Summation : public UnaryOperator<T,M>  {
   public:
     Summation(Function<T,M>* f) : UnaryOperator<T,M>(f) {}
 
-    // f(a) = S(a)
-    Matrix<T,M> compute() {
-      auto& value = this->_function->forward();
-      Matrix<T,M> m(value.context(), 1, 1);
-      m.set(value.S());
-      return m;
+    // f(a) = S(a), per sample
+    void compute_into(Matrix<T,M>& out) {
+      this->_function->forward().sums(out);
     }
 
-    // dE/da = dE/df * df/da = d * I
-    void backward(const Matrix<T,M>& d) {
+    // dE/da = dE/df * df/da = d * I, d is broadcast to the shape of a
+    void propagate(const Matrix<T,M>& d) {
       auto& value = this->_function->forward();
-      Matrix<T,M> m(d.context(), value.rows(), value.cols());
-      m.set(d.S());
-      this->_function->backward(m);
+      Matrix<T,M> g(d.context(), value.rows(), value.cols(), d.batch(), false);
+      g.fill(d);
+      this->_function->backward(g);
+    }
+};
+
+template<typename T, template <typename> class M>
+class Reduction : public UnaryOperator<T,M>  {
+  public:
+    Reduction(Function<T,M>* f, ReduceOp op, ReduceAxis axis) :
+    UnaryOperator<T,M>(f) {
+      _op = op;
+      _axis = axis;
+    }
+
+    // f(a) = op over each row or column of a, per sample
+    void compute_into(Matrix<T,M>& out) {
+      this->_function->forward().reduce(_op, _axis, out);
     }
+
+    // dE/da = dE/df * df/da with d spread along the reduced axis,
+    // sum: d, mean: d / n, logsumexp: d * exp(a - f), max: d at the
+    // maxima, tied maxima all get d
+    void propagate(const Matrix<T,M>& d) {
+      auto& a = this->_function->forward();
+      Matrix<T,M> g(d.context(), a.rows(), a.cols(), d.batch(), false);
+      if (_op == REDUCE_MEAN) {
+        g.fill(d * (T(1) / ((_axis == AXIS_ROWS) ? a.cols() : a.rows())));
+      }
+      else if (_op == REDUCE_LOGSUMEXP) {
+        Matrix<T,M> x = a.broadcast(BROADCAST_SUB, *this->_value);
+        x.exponent(x);
+        d.element(x, g);
+      }
+      else if (_op == REDUCE_MAX) {
+        std::vector<T> v = a.broadcast(BROADCAST_SUB, *this->_value);
+        for (std::size_t i=0; i<v.size(); i++) {
+          v[i] = (v[i] == 0) ? 1 : 0;
+        }
+        g = v;
+        d.element(g, g);
+      }
+      else {
+        g.fill(d);
+      }
+      this->_function->backward(g);
+    }
+
+  private:
+    ReduceOp _op;
+    ReduceAxis _axis;
 };
 
 
@@ -211,17 +426,27 @@ class Addition : public BinaryOperator<T,M>  {
     Addition(Function<T,M>* l, Function<T,M>* r) :
     BinaryOperator<T,M>(l, r) {}
 
-    // f(l, r) = l + r
-    Matrix<T,M> compute() {
+    // f(l, r) = l + r, a 1x1, row or column operand is broadcast
+    void compute_into(Matrix<T,M>& out) {
       // no need to store the values for derivatives
-      return this->_lfunction->forward() + this->_rfunction->forward();
+      auto& l = this->_lfunction->forward();
+      auto& r = this->_rfunction->forward();
+      if (this->same(l, r)) {
+        out = l + r;
+      }
+      else if (this->spans(l, r)) {
+        l.broadcast(BROADCAST_ADD, r, out);
+      }
+      else {
+        r.broadcast(BROADCAST_ADD, l, out);
+      }
     }
 
     // dE/dl = dE/df * df/dl = d * I
     // dE/dr = dE/df * df/dr = d * I
-    void backward(const Matrix<T,M>& d) {
-      this->_lfunction->backward(d);
-      this->_rfunction->backward(d);
+    void propagate(const Matrix<T,M>& d) {
+      this->backward_to(this->_lfunction, this->_lfunction->forward(), d);
+      this->backward_to(this->_rfunction, this->_rfunction->forward(), d);
     }
 };
 
@@ -231,16 +456,28 @@ class Subtraction : public BinaryOperator<T,M>  {
     Subtraction(Function<T,M>* l, Function<T,M>* r) :
     BinaryOperator<T,M>(l, r) {}
 
-    // f(l, r) = l - r
-    Matrix<T,M> compute() {
-      return this->_lfunction->forward() - this->_rfunction->forward();
+    // f(l, r) = l - r, a 1x1, row or column operand is broadcast
+    void compute_into(Matrix<T,M>& out) {
+      auto& l = this->_lfunction->forward();
+      auto& r = this->_rfunction->forward();
+      if (this->same(l, r)) {
+        out = l - r;
+      }
+      else if (this->spans(l, r)) {
+        l.broadcast(BROADCAST_SUB, r, out);
+      }
+      else {
+        r.broadcast(BROADCAST_SUB, l, out);
+        out *= -1;
+      }
     }
 
     // dE/dl = dE/df * df/dl = d * I
     // dE/dr = dE/df * df/dr = d * (-I)
-    void backward(const Matrix<T,M>& d) {
-      this->_lfunction->backward(d);
-      this->_rfunction->backward(d * (-1.0));
+    void propagate(const Matrix<T,M>& d) {
+      this->backward_to(this->_lfunction, this->_lfunction->forward(), d);
+      this->backward_to(this->_rfunction, this->_rfunction->forward(),
+        Matrix<T,M>(d * (-1.0)));
     }
 };
 
@@ -251,15 +488,36 @@ class Product : public BinaryOperator<T,M>  {
     BinaryOperator<T,M> (l, r) {}
 
     // f(l, r) = l * r
-    Matrix<T,M> compute() {
-      return this->_lfunction->forward() * this->_rfunction->forward();
+    void compute_into(Matrix<T,M>& out) {
+      this->_lfunction->forward().product(this->_rfunction->forward(), out);
     }
 
-    // dE/dl = dE/df * df/dl = d * r
-    // dE/dr = dE/df * df/dr = d * l
-    void backward(const Matrix<T,M>& d) {
-      this->_lfunction->backward((this->_rfunction->forward() * d).T());
-      this->_rfunction->backward((d * this->_lfunction->forward()).T());
+    // dE/dl = dE/df * df/dl = d * T(r)
+    // dE/dr = dE/df * df/dr = T(l) * d
+    void propagate(const Matrix<T,M>& d) {
+      auto& l = this->_lfunction->forward();
+      auto& r = this->_rfunction->forward();
+
+      // a 1x1 operand scales the other one element-wise
+      if (scalar(l) != scalar(r)) {
+        this->backward_to(this->_lfunction, l, r, d);
+        this->backward_to(this->_rfunction, r, l, d);
+        return;
+      }
+
+      // an unbatched operand sums its derivative over the batch
+      Matrix<T,M> dl(d.context(), l.rows(), l.cols(), l.batch(), false);
+      dl.gemm(false, true, 1, d, r, 0);
+      this->_lfunction->backward(dl);
+
+      Matrix<T,M> dr(d.context(), r.rows(), r.cols(), r.batch(), false);
+      dr.gemm(true, false, 1, l, d, 0);
+      this->_rfunction->backward(dr);
+    }
+
+  private:
+    static bool scalar(const Matrix<T,M>& m) {
+      return m.rows() == 1 && m.cols() == 1;
     }
 };
 
@@ -269,16 +527,18 @@ class Element : public BinaryOperator<T,M>  {
     Element(Function<T,M>* l, Function<T,M>* r) :
     BinaryOperator<T,M> (l, r) {}
 
-    // f(l, r) = l & r
-    Matrix<T,M> compute() {
-      return this->_lfunction->forward() & this->_rfunction->forward();
+    // f(l, r) = l & r, a 1x1, row or column operand is broadcast
+    void compute_into(Matrix<T,M>& out) {
+      this->_lfunction->forward().element(this->_rfunction->forward(), out);
     }
 
     // dE/dl = dE/df * df/dl = d * r
     // dE/dr = dE/df * df/dr = d * l
-    void backward(const Matrix<T,M>& d) {
-      this->_lfunction->backward(this->_rfunction->forward() & d);
-      this->_rfunction->backward(d & this->_lfunction->forward());
+    void propagate(const Matrix<T,M>& d) {
+      auto& l = this->_lfunction->forward();
+      auto& r = this->_rfunction->forward();
+      this->backward_to(this->_lfunction, l, r, d);
+      this->backward_to(this->_rfunction, r, l, d);
     }
 };
 
@@ -0,0 +1,471 @@
+#ifndef _DL_HALF_H_
+#define _DL_HALF_H_
+
+#include <cstdint>
+#include <cstring>
+
+#include "cpu.hh"
+
+// CPU implementation with 16 bit storage and T precision arithmetic
+
+// 16 bit storage formats
+enum HalfFormat {
+  HALF_BF16,  // bfloat16, float range with 8 bit mantissa
+  HALF_FP16,  // IEEE binary16, 11 bit mantissa up to 65504
+};
+
+// conversions between float and 16 bit formats, round to nearest even
+struct Half {
+  static std::uint32_t bits(float f) {
+    std::uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+  }
+
+  static float value(std::uint32_t u) {
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+  }
+
+  static std::uint16_t bf16(float f) {
+    std::uint32_t u = bits(f);
+    if ((u & 0x7fffffff) > 0x7f800000) {
+      // keep NaN quiet after truncation
+      return (u >> 16) | 0x40;
+    }
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+  }
+
+  static float bf16(std::uint16_t h) {
+    return value(std::uint32_t(h) << 16);
+  }
+
+  static std::uint16_t fp16(float f) {
+    std::uint32_t u = bits(f);
+    std::uint32_t sign = u & 0x80000000;
+    u ^= sign;
+
+    std::uint32_t h;
+    if (u >= (127 + 16) << 23) {
+      // overflow to inf, NaN stays NaN
+      h = (u > 0x7f800000) ? 0x7e00 : 0x7c00;
+    }
+    else if (u < (127 - 14) << 23) {
+      // subnormal or zero, float addition does the rounding
+      const std::uint32_t magic = (127 - 15 + 23 - 10 + 1) << 23;
+      h = bits(value(u) + value(magic)) - magic;
+    }
+    else {
+      // rebias the exponent and round the mantissa
+      std::uint32_t odd = (u >> 13) & 1;
+      u += ((std::uint32_t)(15 - 127) << 23) + 0xfff + odd;
+      h = u >> 13;
+    }
+    return h | (sign >> 16);
+  }
+
+  static float fp16(std::uint16_t h) {
+    const std::uint32_t exp = 0x7c00 << 13;
+    std::uint32_t u = (h & 0x7fff) << 13;
+    std::uint32_t e = u & exp;
+    u += (127 - 15) << 23;
+    if (e == exp) {
+      // inf or NaN
+      u += (128 - 16) << 23;
+    }
+    else if (e == 0) {
+      // subnormal, renormalize with float subtraction
+      u = bits(value(u + (1 << 23)) - value(113 << 23));
+    }
+    return value(u | (std::uint32_t(h & 0x8000) << 16));
+  }
+};
+
+// 16 bit matrix buffer with room for capacity elements, a default
+// constructed matrix is an empty view owning no storage
+template<typename T>
+class HalfMatrix {
+  public:
+    HalfMatrix() {
+      _data = NULL;
+      _rows = _cols = 0;
+      _capacity = 0;
+      _mapped = 0;
+      _format = HALF_BF16;
+    }
+
+    HalfMatrix(std::size_t rows, std::size_t cols, std::size_t capacity,
+    const CPUAllocator& allocator, HalfFormat format) {
+      _data = NULL;
+      _rows = rows;
+      _cols = cols;
+      _capacity = capacity;
+      _mapped = 0;
+      _format = format;
+      if (capacity > 0) {
+        _data = static_cast<std::uint16_t*>(
+          allocator.allocate(sizeof(std::uint16_t) * capacity, _mapped));
+      }
+    }
+
+    HalfMatrix(const HalfMatrix& m) = delete;
+
+    // copy values of the same shape
+    HalfMatrix& operator=(const HalfMatrix& m) {
+      if (m._format == _format) {
+        std::memcpy(_data, m._data, sizeof(std::uint16_t) * size());
+      }
+      else {
+        for (std::size_t i=0; i<size(); i++) {
+          T v;
+          m.decode(i, 1, &v);
+          encode(i, 1, &v);
+        }
+      }
+      return *this;
+    }
+
+    ~HalfMatrix() {
+      if (_capacity > 0) {
+        CPUAllocator::deallocate(_data, _mapped);
+      }
+    }
+
+    std::size_t rows() const { return _rows; }
+    std::size_t cols() const { return _cols; }
+    std::size_t size() const { return _rows * _cols; }
+    std::size_t capacity() const { return _capacity; }
+    HalfFormat format() const { return _format; }
+    std::uint16_t* data() { return _data; }
+    const std::uint16_t* data() const { return _data; }
+
+    // decode n elements from lo into r
+    void decode(std::size_t lo, std::size_t n, T* r) const {
+      const std::uint16_t* h = _data + lo;
+      if (_format == HALF_BF16) {
+        for (std::size_t i=0; i<n; i++) {
+          r[i] = Half::bf16(h[i]);
+        }
+      }
+      else {
+        for (std::size_t i=0; i<n; i++) {
+          r[i] = Half::fp16(h[i]);
+        }
+      }
+    }
+
+    // encode n elements of v into lo
+    void encode(std::size_t lo, std::size_t n, const T* v) {
+      std::uint16_t* h = _data + lo;
+      if (_format == HALF_BF16) {
+        for (std::size_t i=0; i<n; i++) {
+          h[i] = Half::bf16(float(v[i]));
+        }
+      }
+      else {
+        for (std::size_t i=0; i<n; i++) {
+          h[i] = Half::fp16(float(v[i]));
+        }
+      }
+    }
+
+    // remap the buffer to a new shape within capacity
+    void reshape(std::size_t rows, std::size_t cols) {
+      _rows = rows;
+      _cols = cols;
+    }
+
+    // remap a view to external storage
+    void rebind(std::uint16_t* data, std::size_t rows, std::size_t cols,
+    HalfFormat format) {
+      _data = data;
+      _rows = rows;
+      _cols = cols;
+      _format = format;
+    }
+
+  private:
+    std::uint16_t* _data;
+    std::size_t _rows;
+    std::size_t _cols;
+    std::size_t _capacity;
+    std::size_t _mapped;
+    HalfFormat _format;
+};
+
+template<typename T>
+class HalfContext : public Context<T, HalfMatrix> {
+  public:
+    typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      Dense;
+    typedef Eigen::Array<T, Eigen::Dynamic, 1> Block;
+    typedef Eigen::Map<Block> BlockMap;
+
+    explicit HalfContext(HalfFormat format = HALF_BF16) {
+      _format = format;
+    }
+
+    // storage format of matrices created by this context
+    HalfFormat get_format() const {
+      return _format;
+    }
+
+    HalfMatrix<T>*
+    create(std::size_t rows, std::size_t cols, std::size_t capacity) const {
+      return new HalfMatrix<T>(rows, cols, capacity, _allocator, _format);
+    }
+
+    std::size_t
+    capacity(const HalfMatrix<T>& a) const {
+      return a.capacity();
+    }
+
+    std::size_t
+    element_bytes() const {
+      return sizeof(std::uint16_t);
+    }
+
+    void
+    reshape(HalfMatrix<T>& a, std::size_t rows, std::size_t cols) const {
+      if (rows * cols <= a.capacity()) {
+        a.reshape(rows, cols);
+      }
+      else {
+        this->on_error("matrix reshape exceeds capacity");
+      }
+    }
+
+    void
+    view(HalfMatrix<T>& r, HalfMatrix<T>& region, std::size_t offset,
+    std::size_t rows, std::size_t cols) const {
+      r.rebind(region.data() + offset, rows, cols, region.format());
+    }
+
+    std::size_t
+    rows(const HalfMatrix<T>& a) const {
+      return a.rows();
+    }
+
+    std::size_t
+    cols(const HalfMatrix<T>& a) const {
+      return a.cols();
+    }
+
+    void
+    set(HalfMatrix<T>& r, const std::vector<T>& s) const {
+      r.encode(0, r.size(), s.data());
+    }
+
+    void
+    get(const HalfMatrix<T>& s, std::vector<T>& r) const {
+      r.resize(s.size());
+      s.decode(0, s.size(), r.data());
+    }
+
+    void
+    set(HalfMatrix<T>& r, T v) const {
+      HalfMatrix<T> one;
+      std::uint16_t h;
+      one.rebind(&h, 1, 1, r.format());
+      one.encode(0, 1, &v);
+      std::fill(r.data(), r.data() + r.size(), h);
+    }
+
+    void
+    add(const HalfMatrix<T>& a, const HalfMatrix<T>& b, HalfMatrix<T>& r)
+    const {
+      if (a.rows() == b.rows() && a.cols() == b.cols()) {
+        binary(a, b, r, [](BlockMap& x, BlockMap& y) { x += y; });
+      }
+      else {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+    }
+
+    void
+    sub(const HalfMatrix<T>& a, const HalfMatrix<T>& b, HalfMatrix<T>& r)
+    const {
+      if (a.rows() == b.rows() && a.cols() == b.cols()) {
+        binary(a, b, r, [](BlockMap& x, BlockMap& y) { x -= y; });
+      }
+      else {
+        this->on_error("dimension mismatch in matrix subtracion");
+      }
+    }
+
+    void
+    add(const HalfMatrix<T>& a, HalfMatrix<T>& r) const {
+      if (a.rows() == r.rows() && a.cols() == r.cols()) {
+        binary(r, a, r, [](BlockMap& x, BlockMap& y) { x += y; });
+      }
+      else {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+    }
+
+    void
+    sub(const HalfMatrix<T>& a, HalfMatrix<T>& r) const {
+      if (a.rows() == r.rows() && a.cols() == r.cols()) {
+        binary(r, a, r, [](BlockMap& x, BlockMap& y) { x -= y; });
+      }
+      else {
+        this->on_error("dimension mismatch in matrix subtracion");
+      }
+    }
+
+    void
+    scale(T s, HalfMatrix<T>& r) const {
+      unary(r, r, [s](BlockMap& x) { x *= s; });
+    }
+
+    void
+    axpy(T s, const HalfMatrix<T>& a, HalfMatrix<T>& r) const {
+      if (a.rows() == r.rows() && a.cols() == r.cols()) {
+        binary(r, a, r, [s](BlockMap& x, BlockMap& y) { x += s * y; });
+      }
+      else {
+        this->on_error("dimension mismatch in matrix axpy");
+      }
+    }
+
+    // operands are decoded to T and multiplied with T accumulation
+    void
+    gemm(bool ta, bool tb, T alpha,
+    const HalfMatrix<T>& a, const HalfMatrix<T>& b, T beta,
+    HalfMatrix<T>& r) const {
+      if ((ta ? a.rows() : a.cols()) != (tb ? b.cols() : b.rows()) ||
+      r.rows() != (ta ? a.cols() : a.rows()) ||
+      r.cols() != (tb ? b.rows() : b.cols())) {
+        this->on_error("dimension mismatch in matrix-product multiplication");
+        return;
+      }
+
+      Dense da, db, dr;
+      decode(a, da);
+      decode(b, db);
+      if (beta == 0) {
+        dr.resize(r.rows(), r.cols());
+        dr.setZero();
+      }
+      else {
+        decode(r, dr);
+        dr *= beta;
+      }
+
+      if (ta && tb) {
+        dr.noalias() += alpha * da.transpose() * db.transpose();
+      }
+      else if (ta) {
+        dr.noalias() += alpha * da.transpose() * db;
+      }
+      else if (tb) {
+        dr.noalias() += alpha * da * db.transpose();
+      }
+      else {
+        dr.noalias() += alpha * da * db;
+      }
+      r.encode(0, r.size(), dr.data());
+    }
+
+    void
+    mul(const HalfMatrix<T>& a, T s, HalfMatrix<T>& r) const {
+      unary(a, r, [s](BlockMap& x) { x *= s; });
+    }
+
+    void
+    mul(const HalfMatrix<T>& a, const HalfMatrix<T>& b, HalfMatrix<T>& r)
+    const {
+      if (a.cols() == b.cols() && a.rows() == b.rows()) {
+        binary(a, b, r, [](BlockMap& x, BlockMap& y) { x *= y; });
+      }
+      else {
+        this->on_error("dimension mismatch in matrix-element multiplication");
+      }
+    }
+
+    void
+    exponent(const HalfMatrix<T>& a, HalfMatrix<T>& r) const {
+      unary(a, r, [](BlockMap& x) { x = x.exp(); });
+    }
+
+    // transpose moves the 16 bit values without conversion
+    void
+    transpose(const HalfMatrix<T>& a, HalfMatrix<T>& r) const {
+      std::size_t rows = a.rows();
+      std::size_t cols = a.cols();
+      const std::uint16_t* s = a.data();
+      std::uint16_t* d = r.data();
+      for (std::size_t i=0; i<rows; i++) {
+        for (std::size_t j=0; j<cols; j++) {
+          d[j * rows + i] = s[i * cols + j];
+        }
+      }
+    }
+
+    // block sums accumulate in T
+    T
+    summation(const HalfMatrix<T>& a) const {
+      T x[BLOCK];
+      T sum = 0;
+      for (std::size_t lo=0; lo<a.size(); lo+=BLOCK) {
+        std::size_t n = block(a.size(), lo);
+        a.decode(lo, n, x);
+        sum += BlockMap(x, n).sum();
+      }
+      return sum;
+    }
+
+  private:
+    // elements decoded at a time by element-wise ops
+    static const std::size_t BLOCK = 256;
+
+    // length of the block starting at lo
+    static std::size_t block(std::size_t size, std::size_t lo) {
+      std::size_t n = size - lo;
+      if (n > BLOCK) {
+        n = BLOCK;
+      }
+      return n;
+    }
+
+    // decode a whole matrix to T
+    static void decode(const HalfMatrix<T>& a, Dense& r) {
+      r.resize(a.rows(), a.cols());
+      a.decode(0, a.size(), r.data());
+    }
+
+    // r = f(a) in blocks decoded to T
+    template <typename F>
+    static void unary(const HalfMatrix<T>& a, HalfMatrix<T>& r, F f) {
+      T x[BLOCK];
+      for (std::size_t lo=0; lo<a.size(); lo+=BLOCK) {
+        std::size_t n = block(a.size(), lo);
+        a.decode(lo, n, x);
+        BlockMap mx(x, n);
+        f(mx);
+        r.encode(lo, n, x);
+      }
+    }
+
+    // r = f(a, b) in blocks decoded to T, the result is left in the first
+    template <typename F>
+    static void binary(const HalfMatrix<T>& a, const HalfMatrix<T>& b,
+    HalfMatrix<T>& r, F f) {
+      T x[BLOCK], y[BLOCK];
+      for (std::size_t lo=0; lo<a.size(); lo+=BLOCK) {
+        std::size_t n = block(a.size(), lo);
+        a.decode(lo, n, x);
+        b.decode(lo, n, y);
+        BlockMap mx(x, n), my(y, n);
+        f(mx, my);
+        r.encode(lo, n, x);
+      }
+    }
+
+    HalfFormat _format;
+    CPUAllocator _allocator;
+};
+
+#endif /*_DL_HALF_H_*/
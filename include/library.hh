@@ -1,10 +1,13 @@
 #ifndef _DL_LIBRARY_
 #define _DL_LIBRARY_
 
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
 #include <iostream>
 
 #include "function.hh"
+#include "threads.hh"
 
 // standar operator types, enum values are persisted - do not change them
 enum OperatorType {
@@ -21,6 +24,10 @@ enum OperatorType {
 
 class Definition {
   public:
+    Definition() {
+      _recurrent = false;
+    }
+
     const std::string& get_name() const { return _name; }
 
     void set_name(const std::string& name) { _name = name; }
@@ -41,6 +48,15 @@ class Definition {
       return -1;
     }
 
+    // get expression id by name, -1 if not defined
+    int get_id(const std::string& name) const {
+      auto&& it = _index.find(name);
+      if (it != _index.end()) {
+        return it->second;
+      }
+      return -1;
+    }
+
     // get sequential record, return size of the read record
     int get_record(int& offset, OperatorType& type, int& variant, int& id,
     std::vector<int>& input, std::vector<int>& times) const {
@@ -242,6 +258,99 @@ class Definition {
     bool _recurrent;
 };
 
+// buffer slot plan for definition intermediates, expressions whose
+// lifetimes do not overlap share a slot; variables, constants, imports,
+// the return value and values referenced by other time frames get none
+class MemoryPlan {
+  public:
+    MemoryPlan(const Definition& def) {
+      // liveness by record position: expression id, last use position
+      // and whether the value can share a slot
+      OperatorType type;
+      int variant, id, offset = 0;
+      std::vector<int> input, times;
+      std::unordered_map<int, std::size_t> position;
+      std::vector<int> ids;
+      std::vector<std::size_t> last;
+      std::vector<bool> planned;
+      int ret = def.get_id("return");
+      while (def.get_record(offset, type, variant, id, input, times) > 0) {
+        std::size_t p = ids.size();
+        position[id] = p;
+        ids.push_back(id);
+        last.push_back(p);
+        planned.push_back(type != VARIABLE && type != CONSTANT &&
+          type != FUNCTION);
+        for (std::size_t i=0; i<input.size(); i++) {
+          auto it = position.find(input[i]);
+          if (it == position.end()) {
+            continue;
+          }
+          if (times[i] == 0) {
+            last[it->second] = p;
+          }
+          else {
+            planned[it->second] = false;
+          }
+        }
+        input.clear();
+        times.clear();
+      }
+      if (position.count(ret) > 0) {
+        planned[position[ret]] = false;
+      }
+
+      // greedy slot assignment in definition order, a slot is free
+      // again after the last use of its expression
+      std::vector<std::vector<std::size_t>> expired(ids.size() + 1);
+      std::vector<int> free, slots(ids.size(), -1);
+      _slot_count = 0;
+      for (std::size_t p=0; p<ids.size(); p++) {
+        for (auto e: expired[p]) {
+          free.push_back(slots[e]);
+        }
+        if (planned[p]) {
+          if (free.size() > 0) {
+            slots[p] = free.back();
+            free.pop_back();
+          }
+          else {
+            slots[p] = _slot_count++;
+          }
+          expired[last[p] + 1].push_back(p);
+        }
+      }
+
+      // slots by expression id
+      int size = 0;
+      for (auto i: ids) {
+        size = std::max(size, i + 1);
+      }
+      _slots.assign(size, -1);
+      for (std::size_t p=0; p<ids.size(); p++) {
+        _slots[ids[p]] = slots[p];
+      }
+    }
+
+    // get buffer slot of expression id, -1 if not planned
+    int slot(int id) const {
+      return (id >= 0 && std::size_t(id) < _slots.size()) ? _slots[id] : -1;
+    }
+
+    // get buffer slot count
+    int slots() const { return _slot_count; }
+
+    // get planned expression count
+    int size() const { return _slots.size(); }
+
+  private:
+    // buffer slots: _slots[id] -> slot
+    std::vector<int> _slots;
+
+    // buffer slot count
+    int _slot_count;
+};
+
 class Dictionary {
   public:
     // clear definitions from memory
@@ -291,6 +400,14 @@ class Runtime : public Function<T,M> {
 
     Runtime() {
       _main = NULL;
+      _block = NULL;
+      _scheduler = NULL;
+      _context = NULL;
+      _restoring = false;
+    }
+
+    virtual ~Runtime() {
+      delete _block;
     }
 
     void add_expression(Function<T,M>* f) {
@@ -308,6 +425,50 @@ class Runtime : public Function<T,M> {
       _constants.push_back(f);
     }
 
+    // append an operator or child runtime to the execution plan, steps
+    // are added after the steps of their inputs and backward through them
+    // is deferred to the reverse pass of the runtime
+    void add_step(Function<T,M>* f, const std::vector<Function<T,M>*>& inputs) {
+      int step = _steps.size();
+      std::vector<int> deps;
+      for (auto in: inputs) {
+        auto it = _step_index.find(in);
+        if (it != _step_index.end()) {
+          deps.push_back(it->second);
+          _consumers[it->second].push_back(step);
+          continue;
+        }
+        auto ext = std::find(_external.begin(), _external.end(), in);
+        if (ext == _external.end()) {
+          _external.push_back(in);
+          _readers.push_back(std::vector<int>());
+          _seen.push_back(0);
+          ext = _external.end() - 1;
+        }
+        _readers[ext - _external.begin()].push_back(step);
+      }
+      _step_index[f] = step;
+      _steps.push_back(f);
+      _inputs.push_back(deps);
+      _consumers.push_back(std::vector<int>());
+      _dirty.push_back(true);
+      f->set_deferred(true);
+    }
+
+    // add a runtime of an earlier time frame that steps read from
+    void add_upstream(Runtime* rt) {
+      if (std::find(_upstream.begin(), _upstream.end(), rt) ==
+      _upstream.end()) {
+        _upstream.push_back(rt);
+      }
+    }
+
+    // run independent steps concurrently on the scheduler, NULL runs the
+    // plan serially; the scheduler is not owned
+    void set_scheduler(Scheduler* scheduler) {
+      _scheduler = scheduler;
+    }
+
     const std::vector<Function<T,M>*>& expressions() const {
       return _expressions;
     }
@@ -320,16 +481,269 @@ class Runtime : public Function<T,M> {
       return _constants;
     }
 
-    virtual const Matrix<T,M>& forward() { return _main->forward(); }
+    // execution plan in topological order
+    const std::vector<Function<T,M>*>& steps() const {
+      return _steps;
+    }
+
+    // indices of the steps each step takes as input
+    const std::vector<std::vector<int>>& inputs() const {
+      return _inputs;
+    }
+
+    virtual const Matrix<T,M>& forward() {
+      evaluate();
+      return _main->forward();
+    }
+
+    virtual std::size_t version() const {
+      return _main->version();
+    }
+
+    // run the plan in one loop, inputs of each step are already computed
+    // so no step recurses into its inputs; with a scheduler steps run as
+    // soon as their inputs are done. A refreshed runtime runs every step,
+    // otherwise only the steps that depend on inputs from outside the plan
+    // whose version changed since the last run. Planned values share
+    // slots and are all recomputed on any change, a step reusing a slot
+    // is scheduled after the readers of the previous value in the slot.
+    // Each step runs in a step of the context of the outside inputs. A
+    // recomputed step drops a gradient it has not propagated, unless the
+    // run restores values dropped by release() for a pending reverse pass.
+    virtual void evaluate() {
+      bool all = (this->_cache == false), stale = false;
+      for (std::size_t i=0; i<_external.size(); i++) {
+        _context = &_external[i]->forward().context();
+        auto version = _external[i]->version();
+        if (version != _seen[i]) {
+          _seen[i] = version;
+          stale = true;
+          for (auto step: _readers[i]) {
+            invalidate(step);
+          }
+        }
+      }
+      if (all || (stale && _block != NULL)) {
+        std::fill(_dirty.begin(), _dirty.end(), true);
+      }
+
+      if (_scheduler == NULL) {
+        for (std::size_t i=0; i<_steps.size(); i++) {
+          run(i);
+        }
+      }
+      else {
+        _scheduler->run((_block != NULL) ? _order : _inputs, false,
+        [this](std::size_t i) {
+          run(i);
+        });
+      }
+      this->_cache = true;
+      _restoring = false;
+    }
+
+    // backward of a runtime called on its own, not as a step of another
+    // runtime, also runs the reverse passes of the earlier time frames it
+    // passed gradients to, each after all the frames that read from it
+    virtual void backward(const Matrix<T,M>& d) {
+      if (this->_deferred) {
+        Function<T,M>::backward(d);
+        return;
+      }
+      propagate(d);
+      for (auto rt: upstream()) {
+        rt->reverse();
+      }
+    }
+
+    // one reverse pass over the plan, steps are deferred so each sums the
+    // gradients of all its consumers and propagates them once; gradients
+    // passed to steps of earlier time frames wait for their own pass
+    virtual void propagate(const Matrix<T,M>& d) {
+      if (planned()) {
+        return;
+      }
+      _main->backward(d);
+      reverse();
+    }
 
-    virtual void backward(const Matrix<T,M>& d) { _main->backward(d); }
+    // reverse pass over the plan with only the gradients passed in from
+    // later time frames
+    void reverse() {
+      if (planned()) {
+        return;
+      }
+      if (_scheduler == NULL) {
+        for (std::size_t i=_steps.size(); i>0; i--) {
+          flush(i - 1);
+        }
+      }
+      else {
+        _scheduler->run(_inputs, true, [this](std::size_t i) {
+          flush(i);
+        });
+      }
+    }
 
     virtual void refresh(bool deep) {
       Function<T,M>::refresh(deep);
       if (deep) for (auto f: _expressions) f->refresh(deep);
     }
 
+    // drop the values and gradient buffers of the steps and of child
+    // runtimes, the next forward recomputes the values; planned values
+    // stay bound to their block
+    virtual void release() {
+      if (_block == NULL) {
+        Function<T,M>::release();
+        for (auto f: _steps) {
+          f->release();
+        }
+        _restoring = true;
+      }
+    }
+
+    // bind planned expression values to slots of one preallocated block,
+    // shapes are taken from a previous forward, values of slot sharing
+    // expressions are overwritten so the plan is for forward only and
+    // backward reports an error
+    void plan(const MemoryPlan& plan) {
+      // slot sizes from current value shapes
+      std::vector<std::size_t> rows(plan.size()), cols(plan.size());
+      std::vector<std::size_t> sizes(plan.slots(), 0);
+      for (int id=0; id<plan.size(); id++) {
+        if (plan.slot(id) >= 0) {
+          auto& value = _expressions[id]->forward();
+          rows[id] = value.rows();
+          cols[id] = value.cols();
+          auto size = value.context().align_size(rows[id] * cols[id]);
+          sizes[plan.slot(id)] = std::max(sizes[plan.slot(id)], size);
+        }
+      }
+
+      // slot offsets in the block
+      std::vector<std::size_t> offsets(plan.slots(), 0);
+      std::size_t total = 0;
+      for (int i=0; i<plan.slots(); i++) {
+        offsets[i] = total;
+        total += sizes[i];
+      }
+
+      // bind values to block views
+      if (total == 0) {
+        return;
+      }
+      auto& ctx = _main->forward().context();
+      delete _block;
+      _block = new Matrix<T,M>(ctx, 1, total, true);
+      for (int id=0; id<plan.size(); id++) {
+        if (plan.slot(id) >= 0) {
+          _expressions[id]->set_value(new Matrix<T,M>(
+            *_block, offsets[plan.slot(id)], rows[id], cols[id], true));
+        }
+      }
+
+      // the plan reuses a slot in definition order, so a step writing a
+      // slot waits for the step that wrote it before and for its readers
+      _order = _inputs;
+      std::vector<int> writer(plan.slots(), -1);
+      for (int id=0; id<plan.size(); id++) {
+        int slot = plan.slot(id);
+        if (slot < 0) {
+          continue;
+        }
+        int step = _step_index[_expressions[id]];
+        int prev = writer[slot];
+        if (prev >= 0) {
+          _order[step].push_back(prev);
+          _order[step].insert(_order[step].end(), _consumers[prev].begin(),
+            _consumers[prev].end());
+        }
+        writer[slot] = step;
+      }
+      refresh(true);
+    }
+
   private:
+    // planned values of slot sharing expressions are overwritten, so a
+    // planned runtime has no values to run backward with
+    bool planned() const {
+      if (_block != NULL) {
+        _block->context().on_error("backward through a planned runtime");
+        return true;
+      }
+      return false;
+    }
+
+    // mark a step and its transitive consumers for recomputation
+    void invalidate(int step) {
+      std::vector<int> stack(1, step);
+      while (stack.size() > 0) {
+        step = stack.back();
+        stack.pop_back();
+        if (!_dirty[step]) {
+          _dirty[step] = true;
+          stack.insert(stack.end(), _consumers[step].begin(),
+            _consumers[step].end());
+        }
+      }
+    }
+
+    // opens a step on the arena of the calling thread for its scope
+    struct Step {
+      explicit Step(Context<T,M>* ctx) : _ctx(ctx) {
+        if (_ctx != NULL) _ctx->begin_step();
+      }
+      ~Step() {
+        if (_ctx != NULL) _ctx->end_step();
+      }
+      Context<T,M>* _ctx;
+    };
+
+    // recompute a marked step
+    void run(std::size_t step) {
+      if (_dirty[step]) {
+        _dirty[step] = false;
+        if (!_restoring) {
+          _steps[step]->discard();
+        }
+        Step arena(_context);
+        _steps[step]->evaluate();
+      }
+    }
+
+    // runtimes of earlier frames reachable through time references,
+    // each after every runtime that reads from it
+    std::vector<Runtime*> upstream() {
+      std::vector<Runtime*> order;
+      std::unordered_set<Runtime*> seen;
+      std::vector<std::pair<Runtime*, std::size_t>> stack(1, {this, 0});
+      seen.insert(this);
+      while (stack.size() > 0) {
+        auto rt = stack.back().first;
+        auto i = stack.back().second++;
+        if (i < rt->_upstream.size()) {
+          auto next = rt->_upstream[i];
+          if (seen.insert(next).second) {
+            stack.push_back({next, 0});
+          }
+        }
+        else {
+          order.push_back(rt);
+          stack.pop_back();
+        }
+      }
+      order.pop_back();
+      std::reverse(order.begin(), order.end());
+      return order;
+    }
+
+    // propagate the gradients summed by a step
+    void flush(std::size_t step) {
+      Step arena(_context);
+      _steps[step]->flush();
+    }
+
     // all runtime expressions: _instances[index] -> function
     std::vector<Function<T,M>*> _expressions;
 
@@ -339,8 +753,52 @@ class Runtime : public Function<T,M> {
     // constant instances: _constants[index] -> constant
     std::vector<Function<T,M>*> _constants;
 
+    // execution plan: operators and child runtimes in topological order
+    std::vector<Function<T,M>*> _steps;
+
+    // step inputs: _inputs[step] -> input steps
+    std::vector<std::vector<int>> _inputs;
+
+    // planned step order: _order[step] -> input steps and the steps that
+    // last wrote and read the slot it reuses
+    std::vector<std::vector<int>> _order;
+
+    // step index: _step_index[function] -> step
+    std::unordered_map<Function<T,M>*, int> _step_index;
+
+    // step consumers: _consumers[step] -> consuming steps
+    std::vector<std::vector<int>> _consumers;
+
+    // steps to recompute on the next run
+    std::vector<char> _dirty;
+
+    // inputs of steps from outside the plan
+    std::vector<Function<T,M>*> _external;
+
+    // readers of outside inputs: _readers[input] -> consuming steps
+    std::vector<std::vector<int>> _readers;
+
+    // outside input versions seen by the last run
+    std::vector<std::size_t> _seen;
+
+    // concurrent step scheduler
+    Scheduler* _scheduler;
+
     // main function
     Function<T,M>* _main;
+
+    // planned value block
+    Matrix<T,M>* _block;
+
+    // context of the outside inputs, steps take transient matrices from
+    // its step arena
+    Context<T,M>* _context;
+
+    // runtimes of earlier time frames the steps read from
+    std::vector<Runtime*> _upstream;
+
+    // the next run restores values dropped by release()
+    bool _restoring;
 };
 
 // runtime frame: index -> runtime
@@ -360,7 +818,8 @@ class ZeroFeed : public Function<T,M> {
       }
 
       auto& m = _delegate->forward();
-      this->_value = new Matrix<T,M>(m.context(), m.rows(), m.cols());
+      this->_value = new Matrix<T,M>(m.context(), m.rows(), m.cols(),
+        m.batch(), true);
       this->_value->set(0);
       return *this->_value;
     }
@@ -374,10 +833,27 @@ class ZeroFeed : public Function<T,M> {
 template<typename T, template <typename> class M>
 class Timeline {
   public:
+    Timeline() {
+      _scheduler = NULL;
+      _checkpoints = 0;
+      _lag = 0;
+    }
+
     ~Timeline() {
       clear();
     }
 
+    // run runtimes in time and space on the scheduler, NULL runs them
+    // serially; the scheduler is not owned
+    void set_scheduler(Scheduler* scheduler) {
+      _scheduler = scheduler;
+      for (auto frame: _timeline) {
+        for (auto rt: *frame) {
+          rt->set_scheduler(scheduler);
+        }
+      }
+    }
+
     // get timeline size in time
     int space_size() const {
       return (_timeline.size() > 0) ? _timeline[0]->size() : 0;
@@ -389,6 +865,65 @@ class Timeline {
     // clear timeline cache
     void refresh() { for (auto f: _expressions) f->refresh(false); }
 
+    // keep values only of the last frames of every segment of k frames,
+    // as many as the next segment reads back in time, and recompute the
+    // rest a segment at a time during backward; k near the square root
+    // of the time size keeps O(sqrt T) frames, 0 keeps every frame
+    void set_checkpoints(int k) {
+      _checkpoints = k;
+    }
+
+    // frame values of the runtime at the given space were dropped
+    bool released(int time, int space = 0) const {
+      return space >= 0 && std::size_t(space) < _released.size() &&
+        time >= 0 && std::size_t(time) < _released[space].size() &&
+        _released[space][time];
+    }
+
+    // forward runtimes at the given space in time order, frames between
+    // checkpoints drop their values once no later frame reads them
+    void forward(int space) {
+      frames(space).assign(time_size(), false);
+      for (int t=0; t<time_size(); t++) {
+        get_runtime(t, space)->forward();
+        release(t - _lag, space);
+      }
+    }
+
+    // backward through time at the given space, d[time] is the gradient
+    // of the runtime at that time or NULL; dropped frames of a segment are
+    // recomputed from the checkpoints before it and dropped again after
+    void backward(int space, const std::vector<const Matrix<T,M>*>& d) {
+      if (d.size() != std::size_t(time_size())) {
+        throw std::runtime_error("Mismatched gradient and time size.");
+      }
+      auto& released = frames(space);
+      released.resize(time_size(), false);
+      for (int end=time_size(); end>0;) {
+        int begin = 0;
+        if (_checkpoints > 0) {
+          begin = (end - 1) / _checkpoints * _checkpoints;
+        }
+        for (int t=begin; t<end; t++) {
+          if (released[t]) {
+            get_runtime(t, space)->forward();
+            released[t] = false;
+          }
+        }
+        for (int t=end-1; t>=begin; t--) {
+          auto rt = get_runtime(t, space);
+          if (d[t] != NULL) {
+            rt->propagate(*d[t]);
+          }
+          else {
+            rt->reverse();
+          }
+          release(t, space);
+        }
+        end = begin;
+      }
+    }
+
     // clear all runtimes in time and space
     void clear() {
       // clear timeline
@@ -419,6 +954,7 @@ class Timeline {
 
       // add new rt to runtime frame
       auto rt = new Runtime<T,M>();
+      rt->set_scheduler(_scheduler);
       rt_frame.push_back(rt);
       _expressions.push_back(rt);
 
@@ -435,6 +971,9 @@ class Timeline {
         // resolve input
         int size = input.size();
         for (int i=0; i<size; i++) {
+          // frames read back in time
+          _lag = std::max(_lag, -times[i]);
+
           // current time
           if (times[i] == 0) {
             finput.push_back(rt->expressions()[input[i]]);
@@ -444,6 +983,7 @@ class Timeline {
             auto& passed_frame = *_timeline[time + times[i]];
             auto passed_rt = passed_frame[rt_index];
             finput.push_back(passed_rt->expressions()[input[i]]);
+            rt->add_upstream(passed_rt);
           }
           // unavailable passed time
           else {
@@ -461,6 +1001,7 @@ class Timeline {
             auto child_id = add_runtime(time, dict, *child_def, finput);
             auto child_rt = get_runtime(time, child_id);
             rt->add_expression(child_rt);
+            rt->add_step(child_rt, finput);
             break;
           }
           case VARIABLE:
@@ -486,25 +1027,32 @@ class Timeline {
           case ADDITION:
             _expressions.push_back(new Addition<T,M>(finput[0], finput[1]));
             rt->add_expression(_expressions.back());
+            rt->add_step(_expressions.back(), finput);
             break;
           case SUBTRACTION:
             _expressions.push_back(new Subtraction<T,M>(finput[0], finput[1]));
             rt->add_expression(_expressions.back());
+            rt->add_step(_expressions.back(), finput);
             break;
           case PRODUCT:
             _expressions.push_back(new Product<T,M>(finput[0], finput[1]));
             rt->add_expression(_expressions.back());
+            rt->add_step(_expressions.back(), finput);
             break;
           case ELEMENT:
             _expressions.push_back(new Element<T,M>(finput[0], finput[1]));
             rt->add_expression(_expressions.back());
+            rt->add_step(_expressions.back(), finput);
+            break;
           case TRANSPOSE:
             _expressions.push_back(new Transpose<T,M>(finput[0]));
             rt->add_expression(_expressions.back());
+            rt->add_step(_expressions.back(), finput);
             break;
           case EXPONENT:
             _expressions.push_back(new Exponent<T,M>(finput[0]));
             rt->add_expression(_expressions.back());
+            rt->add_step(_expressions.back(), finput);
             break;
           default:
             throw std::runtime_error("Unknown operator type in definition.");
@@ -568,11 +1116,42 @@ class Timeline {
     }
 
   private:
+    // drop the values of the runtime at a space of a frame between
+    // checkpoints, the last frame keeps its values for the caller
+    void release(int time, int space) {
+      if (_checkpoints <= 0 || time < 0 || time >= time_size() - 1 ||
+      time % _checkpoints + _lag >= _checkpoints) {
+        return;
+      }
+      get_runtime(time, space)->release();
+      frames(space)[time] = true;
+    }
+
+    // released frame flags of a space
+    std::vector<char>& frames(int space) {
+      if (_released.size() <= std::size_t(space)) {
+        _released.resize(space + 1);
+      }
+      return _released[space];
+    }
+
     // timeline for recurrent networks
     std::vector<RuntimeFrame<T,M>*> _timeline;
 
     // all expression references
     std::vector<Function<T,M>*> _expressions;
+
+    // concurrent step scheduler of new runtimes
+    Scheduler* _scheduler;
+
+    // checkpoint segment length, 0 keeps every frame
+    int _checkpoints;
+
+    // most frames any runtime reads back in time
+    int _lag;
+
+    // frames with dropped values: _released[space][time] -> dropped
+    std::vector<std::vector<char>> _released;
 };
 
 #endif /*_DL_LIBRARY_*/
@@ -1,30 +1,135 @@
 #ifndef _DL_MATRIX_H_
 #define _DL_MATRIX_H_
 
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
 #include "context.hh"
 
+template <typename B, template <typename> class M> class Matrix;
+
+// backends whose matrices support native element-wise +, - and scalar *
+// expressions specialize this to evaluate a whole expression in one pass,
+// other backends evaluate node by node with in-place context operations
+template <template <typename> class M>
+struct FusedExpressions : std::false_type {};
+
+// expression operands, nodes are held by value and matrices by reference
+template <typename X>
+struct Nested { typedef const X type; };
+
 template <typename B, template <typename> class M>
-class Matrix {
+struct Nested<Matrix<B,M>> { typedef const Matrix<B,M>& type; };
+
+template <typename B, template <typename> class M, typename L, typename R>
+class Sum;
+
+template <typename B, template <typename> class M, typename L, typename R>
+class Difference;
+
+template <typename B, template <typename> class M, typename E>
+class Scaled;
+
+// lazy element-wise matrix expression, E is the concrete node type,
+// nodes reference their matrix operands and must not outlive them
+template <typename B, template <typename> class M, typename E>
+class Expression {
   public:
+    const E& self() const {
+      return static_cast<const E&>(*this);
+    }
+
+    // add
+    template <typename R>
+    Sum<B,M,E,R> operator+(const Expression<B,M,R>& r) const {
+      return Sum<B,M,E,R>(self(), r.self());
+    }
+
+    // subtract
+    template <typename R>
+    Difference<B,M,E,R> operator-(const Expression<B,M,R>& r) const {
+      return Difference<B,M,E,R>(self(), r.self());
+    }
 
-    // default ctor
+    // scalar multiply
+    Scaled<B,M,E> operator*(B s) const {
+      return Scaled<B,M,E>(self(), s);
+    }
+
+    // get operator
+    operator std::vector<B>() const {
+      return Matrix<B,M>(self());
+    }
+};
+
+template <typename B, template <typename> class M>
+class Matrix : public Expression<B,M,Matrix<B,M>> {
+  public:
+
+    // default ctor, persistent so user matrices may outlive a step
     Matrix(Context<B,M>& ctx,
     std::size_t rows, std::size_t cols = 1) : _ctx(ctx) {
-      _mtx = _ctx.get_matrix(rows, cols);
+      _persistent = true;
+      _batch = 1;
+      _mtx = _ctx.get_matrix(rows, cols, false);
     }
 
-    // move ctor
-    Matrix(Matrix&& m) : _ctx(m._ctx) {
-      _mtx = m._mtx;
-      m._mtx = NULL;
+    // persistent ctor, never backed by the context step arena
+    Matrix(Context<B,M>& ctx,
+    std::size_t rows, std::size_t cols, bool persistent) : _ctx(ctx) {
+      _persistent = persistent;
+      _batch = 1;
+      _mtx = _ctx.get_matrix(rows, cols, !_persistent);
     }
 
-    // copy ctor
+    // batch ctor, batch samples of rows x cols stored one after another
+    Matrix(Context<B,M>& ctx, std::size_t rows, std::size_t cols,
+    std::size_t batch, bool persistent) : _ctx(ctx) {
+      _persistent = persistent;
+      _batch = batch;
+      _mtx = _ctx.get_matrix(batch * rows, cols, !_persistent);
+    }
+
+    // view ctor, maps block elements from offset
+    Matrix(Matrix& block, std::size_t offset,
+    std::size_t rows, std::size_t cols, bool persistent) : _ctx(block._ctx) {
+      _persistent = persistent;
+      _batch = 1;
+      _mtx = _ctx.get_view(*block._mtx, offset, rows, cols);
+    }
+
+    // move ctor, a persistent matrix copies out of the step arena
+    Matrix(Matrix&& m, bool persistent = false) : _ctx(m._ctx) {
+      _persistent = persistent || m._persistent;
+      _batch = m._batch;
+      if (_persistent && _ctx.is_transient(*m._mtx)) {
+        _mtx = _ctx.get_matrix(m.flat_rows(), m.cols(), false);
+        *_mtx = *m._mtx;
+      }
+      else {
+        _mtx = m._mtx;
+        m._mtx = NULL;
+      }
+    }
+
+    // copy ctor, persistent like the default ctor
     Matrix(const Matrix& m) : _ctx(m._ctx) {
-      _mtx = _ctx.get_matrix(m.rows(), m.cols());
+      _persistent = true;
+      _batch = m._batch;
+      _mtx = _ctx.get_matrix(m.flat_rows(), m.cols(), false);
       *_mtx = *m._mtx;
     }
 
+    // expression ctor, evaluates the expression
+    template <typename E>
+    Matrix(const Expression<B,M,E>& e) : _ctx(e.self().context()) {
+      _persistent = false;
+      _batch = e.self().batch();
+      _mtx = _ctx.get_matrix(_batch * e.self().rows(), e.self().cols());
+      evaluate(e.self(), *_mtx, FusedExpressions<M>());
+    }
+
     // virtual dtor
     virtual ~Matrix() {
       if (_mtx != NULL) {
@@ -37,18 +142,41 @@ class Matrix {
       _ctx.print(*_mtx, out);
     }
 
-    // move assignment
+    // move assignment, a persistent matrix copies out of the step arena
+    // and keeps its own view
     Matrix& operator=(Matrix&& m) {
+      if (_persistent &&
+      (_ctx.is_transient(*m._mtx) || _ctx.is_transient(*_mtx))) {
+        return *this = static_cast<const Matrix&>(m);
+      }
       _ctx.put_matrix(_mtx);
       _mtx = m._mtx;
+      _batch = m._batch;
       m._mtx = NULL;
+      return *this;
     }
 
-    // copy assignment
+    // copy assignment, reuses the buffer if the shape matches
     Matrix& operator=(const Matrix& m) {
-      _ctx.put_matrix(_mtx);
-      _mtx = _ctx.get_matrix(m.rows(), m.cols());
+      if (flat_rows() != m.flat_rows() || cols() != m.cols()) {
+        _ctx.put_matrix(_mtx);
+        _mtx = _ctx.get_matrix(m.flat_rows(), m.cols(), !_persistent);
+      }
+      _batch = m._batch;
       *_mtx = *m._mtx;
+      return *this;
+    }
+
+    // expression assignment, a fused expression is evaluated in place
+    // since element-wise operands may alias this matrix
+    template <typename E>
+    Matrix& operator=(const Expression<B,M,E>& e) {
+      if (!FusedExpressions<M>::value || rows() != e.self().rows() ||
+      cols() != e.self().cols() || batch() != e.self().batch()) {
+        return *this = Matrix(e);
+      }
+      evaluate(e.self(), *_mtx, FusedExpressions<M>());
+      return *this;
     }
 
     // matrix context
@@ -56,9 +184,9 @@ class Matrix {
       return _ctx;
     }
 
-    // row count
+    // row count of a sample
     int rows() const {
-      return _ctx.rows(*_mtx);
+      return _ctx.rows(*_mtx) / _batch;
     }
 
     // col count
@@ -66,6 +194,11 @@ class Matrix {
       return _ctx.cols(*_mtx);
     }
 
+    // sample count
+    int batch() const {
+      return _batch;
+    }
+
     // set
     void set(B v) {
       _ctx.set(*_mtx, v);
@@ -100,89 +233,551 @@ class Matrix {
       return v;
     }
 
-    // add
-    Matrix operator+(const Matrix& m) const {
-      Matrix r(_ctx, rows(), m.cols());
-      _ctx.add(*_mtx, *m._mtx, *r._mtx);
-      return r;
+    // add in place, an unbatched matrix adds all samples of a batched m
+    Matrix& operator+=(const Matrix& m) {
+      if (_batch == m._batch) {
+        _ctx.add(*m._mtx, *_mtx);
+      }
+      else {
+        reduce(1, m);
+      }
+      return *this;
     }
 
-    // subtract
-    Matrix operator-(const Matrix& m) const {
-      Matrix r(_ctx, rows(), m.cols());
-      _ctx.sub(*_mtx, *m._mtx, *r._mtx);
-      return r;
+    // subtract in place, an unbatched matrix subtracts all samples
+    Matrix& operator-=(const Matrix& m) {
+      if (_batch == m._batch) {
+        _ctx.sub(*m._mtx, *_mtx);
+      }
+      else {
+        reduce(-1, m);
+      }
+      return *this;
+    }
+
+    // scalar multiply in place
+    Matrix& operator*=(B s) {
+      _ctx.scale(s, *_mtx);
+      return *this;
+    }
+
+    // add scaled matrix in place, this += s * m, an unbatched matrix adds
+    // all samples of a batched m
+    Matrix& axpy(B s, const Matrix& m) {
+      if (_batch == m._batch) {
+        _ctx.axpy(s, *m._mtx, *_mtx);
+      }
+      else {
+        reduce(s, m);
+      }
+      return *this;
     }
 
     // matrix multiply
     Matrix operator*(const Matrix& m) const {
-      if (rows() == 1 && cols() == 1) {
-        Matrix r(_ctx, m.rows(), m.cols());
-        _ctx.mul(*m._mtx, S(), *r._mtx);
-        return r;
+      Matrix r(_ctx, result_rows(m), scalar() ? m.cols() :
+        (m.scalar() ? cols() : m.cols()), result_batch(m), false);
+      product(m, r);
+      return r;
+    }
+
+    // matrix multiply into r, a 1x1 operand scales the other, samples of
+    // batched operands multiply sample by sample
+    void product(const Matrix& m, Matrix& r) const {
+      if (scalar()) {
+        m.broadcast(BROADCAST_MUL, *this, r);
       }
       else
-      if (m.rows() == 1 && m.cols() == 1) {
-        Matrix r(_ctx, rows(), cols());
-        _ctx.mul(*_mtx, m.S(), *r._mtx);
-        return r;
+      if (m.scalar()) {
+        broadcast(BROADCAST_MUL, m, r);
+      }
+      else {
+        r.resize(rows(), m.cols(), result_batch(m));
+        r.gemm(false, false, 1, *this, m, 0);
+      }
+    }
+
+    // general matrix multiply, this = alpha * op(a) * op(b) + beta * this,
+    // op transposes if ta or tb, this is resized if beta is 0. Batched
+    // operands multiply sample by sample with an unbatched operand shared
+    // by all samples, an unbatched this sums the products over the batch.
+    void gemm(bool ta, bool tb, B alpha,
+    const Matrix& a, const Matrix& b, B beta) {
+      if (beta == 0) {
+        resize(ta ? a.cols() : a.rows(), tb ? b.rows() : b.cols(), _batch);
+      }
+
+      std::size_t n = std::max(a._batch, b._batch);
+      if (n == 1 && _batch == 1) {
+        _ctx.gemm(ta, tb, alpha, *a._mtx, *b._mtx, beta, *_mtx);
+      }
+      else if (!batches(a, b) || (_batch != 1 && _batch != n)) {
+        _ctx.on_error("batch mismatch in matrix-product multiplication");
+      }
+      else if (_batch == n) {
+        batch_gemm(ta, tb, alpha, a, b, beta);
       }
       else {
-        Matrix r(_ctx, rows(), m.cols());
-        _ctx.prod(*_mtx, *m._mtx, *r._mtx);
-        return r;
+        reduce_gemm(ta, tb, alpha, a, b, beta);
       }
     }
 
     // scalar multiply
-    Matrix operator*(B s) const {
-      Matrix r(_ctx, rows(), cols());
-      _ctx.mul(*_mtx, s, *r._mtx);
-      return r;
+    Scaled<B,M,Matrix> operator*(B s) const {
+      return Scaled<B,M,Matrix>(*this, s);
     }
 
     // element multiply
     Matrix operator&(const Matrix& m) const {
-      if (rows() == 1 && cols() == 1) {
-        Matrix r(_ctx, m.rows(), m.cols());
-        _ctx.mul(*m._mtx, S(), *r._mtx);
-        return r;
+      Matrix r(_ctx, std::max(rows(), m.rows()), std::max(cols(), m.cols()),
+        result_batch(m), false);
+      element(m, r);
+      return r;
+    }
+
+    // element multiply into r, a 1x1, row or column operand is broadcast
+    void element(const Matrix& m, Matrix& r) const {
+      if (spans(m)) {
+        broadcast(BROADCAST_MUL, m, r);
       }
-      else
-      if (m.rows() == 1 && m.cols() == 1) {
-        Matrix r(_ctx, rows(), cols());
-        _ctx.mul(*_mtx, m.S(), *r._mtx);
-        return r;
+      else {
+        m.broadcast(BROADCAST_MUL, *this, r);
+      }
+    }
+
+    // broadcast op
+    Matrix broadcast(BroadcastOp op, const Matrix& m) const {
+      Matrix r(_ctx, rows(), cols(), result_batch(m), false);
+      broadcast(op, m, r);
+      return r;
+    }
+
+    // broadcast op into r, r = this op m with m of the shape of this or
+    // 1x1, 1 x cols or rows x 1 repeated over the missing axes, an
+    // unbatched operand is repeated over the samples of the other
+    void broadcast(BroadcastOp op, const Matrix& m, Matrix& r) const {
+      if (!spans(m) || !batches(*this, m)) {
+        _ctx.on_error("dimension mismatch in matrix broadcast");
+        return;
+      }
+      std::size_t n = result_batch(m);
+      r.resize(rows(), cols(), n);
+      if (_batch == n && ((m._batch == 1 && m.rows() == 1) ||
+      (m._batch == n && m.rows() == rows()))) {
+        // m repeats over rows of all samples at once
+        _ctx.broadcast(op, *_mtx, *m._mtx, *r._mtx);
+      }
+      else if (_batch == n && m._batch == n && m.scalar()) {
+        // one scalar per sample repeats over a row of flat samples
+        std::size_t size = rows() * cols();
+        Matrix a = view(*this, 0, n, size), t = view(r, 0, n, size);
+        Matrix s = view(m, 0, n, 1);
+        _ctx.broadcast(op, *a._mtx, *s._mtx, *t._mtx);
       }
       else {
-        Matrix r(_ctx, rows(), m.cols());
-        _ctx.mul(*_mtx, *m._mtx, *r._mtx);
-        return r;
+        for (std::size_t i=0; i<n; i++) {
+          Matrix a = sample(*this, i), s = sample(m, i), t = sample(r, i);
+          _ctx.broadcast(op, *a._mtx, *s._mtx, *t._mtx);
+        }
       }
     }
 
+    // set every element to the broadcast of m
+    void fill(const Matrix& m) {
+      _ctx.set(*_mtx, 0);
+      broadcast(BROADCAST_ADD, m, *this);
+    }
+
     // exponent
     Matrix E() const {
-      Matrix r(_ctx, rows(), cols());
-      _ctx.exponent(*_mtx, *r._mtx);
+      Matrix r(_ctx, rows(), cols(), _batch, false);
+      exponent(r);
       return r;
     }
 
+    // exponent into r
+    void exponent(Matrix& r) const {
+      r.resize(rows(), cols(), _batch);
+      _ctx.exponent(*_mtx, *r._mtx);
+    }
+
     // transpose
     Matrix T() const {
-      Matrix r(_ctx, cols(), rows());
-      _ctx.transpose(*_mtx, *r._mtx);
+      Matrix r(_ctx, cols(), rows(), _batch, false);
+      transpose(r);
       return r;
     }
 
-    // summation
+    // transpose into r, sample by sample
+    void transpose(Matrix& r) const {
+      r.resize(cols(), rows(), _batch);
+      if (_batch == 1) {
+        _ctx.transpose(*_mtx, *r._mtx);
+      }
+      else if (rows() == 1 || cols() == 1) {
+        // vector samples keep their element order
+        Matrix v = view(r, 0, flat_rows(), cols());
+        *v._mtx = *_mtx;
+      }
+      else {
+        for (std::size_t i=0; i<_batch; i++) {
+          Matrix a = sample(*this, i), t = sample(r, i);
+          _ctx.transpose(*a._mtx, *t._mtx);
+        }
+      }
+    }
+
+    // resize, keeps the buffer if the new shape fits in it
+    void resize(std::size_t rows, std::size_t cols, std::size_t batch = 1) {
+      std::size_t flat = batch * rows;
+      _batch = batch;
+      if (flat == flat_rows() && cols == std::size_t(this->cols())) {
+        return;
+      }
+      if (!_ctx.is_transient(*_mtx) && flat * cols <= _ctx.capacity(*_mtx)) {
+        _ctx.reshape(*_mtx, flat, cols);
+      }
+      else {
+        _ctx.put_matrix(_mtx);
+        _mtx = _ctx.get_matrix(flat, cols, !_persistent);
+      }
+    }
+
+    // summation over all samples
     B S() const {
       return _ctx.summation(*_mtx);
     }
 
+    // summation of each sample into a batch of 1x1 matrices
+    void sums(Matrix& r) const {
+      r.resize(1, 1, _batch);
+      if (_batch == 1) {
+        r.set(S());
+        return;
+      }
+      std::vector<B> v(_batch);
+      for (std::size_t i=0; i<_batch; i++) {
+        v[i] = _ctx.summation(*sample(*this, i)._mtx);
+      }
+      r.set(v);
+    }
+
+    // inner product of each sample with m into a batch of 1x1 matrices,
+    // the sum of this & m without an element-wise product
+    void dots(const Matrix& m, Matrix& r) const {
+      std::size_t n = result_batch(m);
+      std::size_t size = rows() * cols();
+      if (m.rows() != rows() || m.cols() != cols() || !batches(*this, m)) {
+        _ctx.on_error("dimension mismatch in matrix inner product");
+        return;
+      }
+      r.resize(1, 1, n);
+      for (std::size_t i=0; i<n; i++) {
+        Matrix a = sample(*this, i), b = sample(m, i), t = sample(r, i);
+        Matrix va = view(a, 0, 1, size), vb = view(b, 0, size, 1);
+        _ctx.gemm(false, false, 1, *va._mtx, *vb._mtx, 0, *t._mtx);
+      }
+    }
+
+    // reduction of each row into rows x 1 or of each column into 1 x cols
+    Matrix reduce(ReduceOp op, ReduceAxis axis) const {
+      Matrix r(_ctx, (axis == AXIS_ROWS) ? rows() : 1,
+        (axis == AXIS_ROWS) ? 1 : cols(), _batch, false);
+      reduce(op, axis, r);
+      return r;
+    }
+
+    // reduction into r sample by sample, rows of all samples reduce at once
+    void reduce(ReduceOp op, ReduceAxis axis, Matrix& r) const {
+      if (axis == AXIS_ROWS) {
+        r.resize(rows(), 1, _batch);
+        _ctx.reduce(op, axis, *_mtx, *r._mtx);
+        return;
+      }
+      r.resize(1, cols(), _batch);
+      if (_batch == 1) {
+        _ctx.reduce(op, axis, *_mtx, *r._mtx);
+        return;
+      }
+      for (std::size_t i=0; i<_batch; i++) {
+        Matrix a = sample(*this, i), t = sample(r, i);
+        _ctx.reduce(op, axis, *a._mtx, *t._mtx);
+      }
+    }
+
+    //
+    // expression interface
+    //
+
+    // native backend matrix
+    const M<B>& native() const {
+      return *_mtx;
+    }
+
+    // native backend matrix for backend specific calls
+    M<B>& native() {
+      return *_mtx;
+    }
+
+    // r = this
+    void assign(M<B>& r) const {
+      r = *_mtx;
+    }
+
+    // r += this
+    void add_to(M<B>& r) const {
+      _ctx.add(*_mtx, r);
+    }
+
+    // r -= this
+    void sub_from(M<B>& r) const {
+      _ctx.sub(*_mtx, r);
+    }
+
+    // r += s * this
+    void axpy_to(B s, M<B>& r) const {
+      _ctx.axpy(s, *_mtx, r);
+    }
+
   private:
+    // check for 1x1 matrix
+    bool scalar() const {
+      return rows() == 1 && cols() == 1;
+    }
+
+    // rows of a product or element multiply with m
+    int result_rows(const Matrix& m) const {
+      return scalar() ? m.rows() : rows();
+    }
+
+    // batch of a product or element multiply with m
+    std::size_t result_batch(const Matrix& m) const {
+      return std::max(_batch, m._batch);
+    }
+
+    // row count of all samples
+    std::size_t flat_rows() const {
+      return _ctx.rows(*_mtx);
+    }
+
+    // check m broadcasts to the sample shape of this
+    bool spans(const Matrix& m) const {
+      return (m.rows() == rows() || m.rows() == 1) &&
+        (m.cols() == cols() || m.cols() == 1);
+    }
+
+    // batch sizes that multiply sample by sample
+    static bool batches(const Matrix& a, const Matrix& b) {
+      return a._batch == b._batch || a._batch == 1 || b._batch == 1;
+    }
+
+    // view of rows x cols elements of m from offset, views of const
+    // matrices are only read through
+    static Matrix
+    view(const Matrix& m, std::size_t offset, std::size_t rows,
+    std::size_t cols) {
+      return Matrix(const_cast<Matrix&>(m), offset, rows, cols, false);
+    }
+
+    // view of sample i, or of the whole matrix if it is unbatched
+    static Matrix sample(const Matrix& m, std::size_t i) {
+      std::size_t size = m.rows() * m.cols();
+      return view(m, (m._batch == 1) ? 0 : i * size, m.rows(), m.cols());
+    }
+
+
+    // this += s * sum of the samples of m
+    void reduce(B s, const Matrix& m) {
+      if (_batch != 1 || m.rows() != rows() || m.cols() != cols()) {
+        _ctx.on_error("batch mismatch in matrix reduction");
+        return;
+      }
+      std::size_t size = rows() * cols();
+      Matrix ones(_ctx, 1, m._batch);
+      ones.set(1);
+      Matrix a = view(m, 0, m._batch, size), t = view(*this, 0, 1, size);
+      _ctx.gemm(false, false, s, *ones._mtx, *a._mtx, 1, *t._mtx);
+    }
+
+    // batched this = alpha * op(a) * op(b) + beta * this
+    void batch_gemm(bool ta, bool tb, B alpha,
+    const Matrix& a, const Matrix& b, B beta) {
+      std::size_t k = ta ? a.rows() : a.cols();
+      if (b._batch == 1 && !ta) {
+        // samples of a stack into one tall operand
+        _ctx.gemm(false, tb, alpha, *a._mtx, *b._mtx, beta, *_mtx);
+      }
+      else if (a._batch == 1 && cols() == 1) {
+        // vector samples of b and this are rows of one operand each
+        Matrix vb = view(b, 0, _batch, k), vr = view(*this, 0, _batch, rows());
+        _ctx.gemm(false, !ta, alpha, *vb._mtx, *a._mtx, beta, *vr._mtx);
+      }
+      else {
+        for (std::size_t i=0; i<_batch; i++) {
+          Matrix va = sample(a, i), vb = sample(b, i), vr = sample(*this, i);
+          _ctx.gemm(ta, tb, alpha, *va._mtx, *vb._mtx, beta, *vr._mtx);
+        }
+      }
+    }
+
+    // unbatched this = alpha * sum of op(a) * op(b) + beta * this
+    void reduce_gemm(bool ta, bool tb, B alpha,
+    const Matrix& a, const Matrix& b, B beta) {
+      std::size_t n = std::max(a._batch, b._batch);
+      std::size_t k = ta ? a.rows() : a.cols();
+      if (k == 1 && a._batch == n && b._batch == n) {
+        // outer products of vector samples sum in one product
+        Matrix va = view(a, 0, n, rows()), vb = view(b, 0, n, cols());
+        _ctx.gemm(true, false, alpha, *va._mtx, *vb._mtx, beta, *_mtx);
+      }
+      else {
+        for (std::size_t i=0; i<n; i++) {
+          Matrix va = sample(a, i), vb = sample(b, i);
+          _ctx.gemm(ta, tb, alpha, *va._mtx, *vb._mtx,
+            (i == 0) ? beta : 1, *_mtx);
+        }
+      }
+    }
+
+    // evaluate expression in one pass with native backend operators
+    template <typename E>
+    static void evaluate(const E& e, M<B>& r, std::true_type) {
+      r = e.native();
+    }
+
+    // a sum of two matrices is one call to the backend kernel
+    static void
+    evaluate(const Sum<B,M,Matrix,Matrix>& e, M<B>& r, std::true_type) {
+      e.context().add(*e.left()._mtx, *e.right()._mtx, r);
+    }
+
+    // a difference of two matrices is one call to the backend kernel
+    static void
+    evaluate(const Difference<B,M,Matrix,Matrix>& e, M<B>& r, std::true_type) {
+      e.context().sub(*e.left()._mtx, *e.right()._mtx, r);
+    }
+
+    // evaluate expression node by node
+    template <typename E>
+    static void evaluate(const E& e, M<B>& r, std::false_type) {
+      e.assign(r);
+    }
+
     M<B>* _mtx;
     Context<B,M>& _ctx;
+
+    // kept out of the step arena
+    bool _persistent;
+
+    // samples stored one after another
+    std::size_t _batch;
+};
+
+// l + r
+template <typename B, template <typename> class M, typename L, typename R>
+class Sum : public Expression<B,M,Sum<B,M,L,R>> {
+  public:
+    Sum(const L& l, const R& r) : _l(l), _r(r) {
+      if (l.rows() != r.rows() || l.cols() != r.cols()) {
+        context().on_error("dimension mismatch in matrix addition");
+      }
+      else if (l.batch() != r.batch()) {
+        context().on_error("batch mismatch in matrix addition");
+      }
+    }
+
+    Context<B,M>& context() const { return _l.context(); }
+    int rows() const { return _l.rows(); }
+    int cols() const { return _l.cols(); }
+    int batch() const { return _l.batch(); }
+    const L& left() const { return _l; }
+    const R& right() const { return _r; }
+
+    template <typename X = L>
+    auto native() const ->
+    decltype(std::declval<const X&>().native() + std::declval<R>().native()) {
+      return _l.native() + _r.native();
+    }
+
+    void assign(M<B>& r) const { _l.assign(r); _r.add_to(r); }
+    void add_to(M<B>& r) const { _l.add_to(r); _r.add_to(r); }
+    void sub_from(M<B>& r) const { _l.sub_from(r); _r.sub_from(r); }
+
+    void axpy_to(B s, M<B>& r) const {
+      _l.axpy_to(s, r);
+      _r.axpy_to(s, r);
+    }
+
+  private:
+    typename Nested<L>::type _l;
+    typename Nested<R>::type _r;
+};
+
+// l - r
+template <typename B, template <typename> class M, typename L, typename R>
+class Difference : public Expression<B,M,Difference<B,M,L,R>> {
+  public:
+    Difference(const L& l, const R& r) : _l(l), _r(r) {
+      if (l.rows() != r.rows() || l.cols() != r.cols()) {
+        context().on_error("dimension mismatch in matrix subtracion");
+      }
+      else if (l.batch() != r.batch()) {
+        context().on_error("batch mismatch in matrix subtracion");
+      }
+    }
+
+    Context<B,M>& context() const { return _l.context(); }
+    int rows() const { return _l.rows(); }
+    int cols() const { return _l.cols(); }
+    int batch() const { return _l.batch(); }
+    const L& left() const { return _l; }
+    const R& right() const { return _r; }
+
+    template <typename X = L>
+    auto native() const ->
+    decltype(std::declval<const X&>().native() - std::declval<R>().native()) {
+      return _l.native() - _r.native();
+    }
+
+    void assign(M<B>& r) const { _l.assign(r); _r.sub_from(r); }
+    void add_to(M<B>& r) const { _l.add_to(r); _r.sub_from(r); }
+    void sub_from(M<B>& r) const { _l.sub_from(r); _r.add_to(r); }
+
+    void axpy_to(B s, M<B>& r) const {
+      _l.axpy_to(s, r);
+      _r.axpy_to(-s, r);
+    }
+
+  private:
+    typename Nested<L>::type _l;
+    typename Nested<R>::type _r;
+};
+
+// e * s
+template <typename B, template <typename> class M, typename E>
+class Scaled : public Expression<B,M,Scaled<B,M,E>> {
+  public:
+    Scaled(const E& e, B s) : _e(e), _s(s) {}
+
+    Context<B,M>& context() const { return _e.context(); }
+    int rows() const { return _e.rows(); }
+    int cols() const { return _e.cols(); }
+    int batch() const { return _e.batch(); }
+
+    template <typename X = E>
+    auto native() const ->
+    decltype(std::declval<const X&>().native() * std::declval<B>()) {
+      return _e.native() * _s;
+    }
+
+    void assign(M<B>& r) const { _e.assign(r); context().scale(_s, r); }
+    void add_to(M<B>& r) const { _e.axpy_to(_s, r); }
+    void sub_from(M<B>& r) const { _e.axpy_to(-_s, r); }
+    void axpy_to(B s, M<B>& r) const { _e.axpy_to(s * _s, r); }
+
+  private:
+    typename Nested<E>::type _e;
+    B _s;
 };
 
 #endif /*_DL_MATRIX_H_*/
@@ -0,0 +1,260 @@
+#ifndef _DL_PARALLEL_H_
+#define _DL_PARALLEL_H_
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "cpu.hh"
+#include "threads.hh"
+
+// Multi-threaded CPU implementation with Eigen
+
+///////////////////////////////////
+// parallel CPU context
+///////////////////////////////////
+template<typename T>
+class ParallelCPUContext : public CPUContext<T> {
+  public:
+    // threads 0 uses one thread per hardware core
+    explicit ParallelCPUContext(std::size_t threads = 0) :
+    _pool(threads > 0 ? threads :
+      std::max(1u, std::thread::hardware_concurrency())) {
+      _threshold = 32 * 1024;
+    }
+
+    // smallest amount of scalar operations given to one thread,
+    // smaller ops run serially on the calling thread
+    void set_threshold(std::size_t threshold) {
+      _threshold = std::max<std::size_t>(threshold, 1);
+    }
+
+    // number of threads running an op
+    std::size_t get_threads() const {
+      return _pool.size();
+    }
+
+    void
+    add(const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
+      if (!same(a, b) || !same(a, r) ||
+      !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vb(at(b, lo), 1, n);
+        CPUMatrix<T> vr(at(r, lo), 1, n);
+        CPUContext<T>::add(va, vb, vr);
+      })) {
+        CPUContext<T>::add(a, b, r);
+      }
+    }
+
+    void
+    sub(const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
+      if (!same(a, b) || !same(a, r) ||
+      !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vb(at(b, lo), 1, n);
+        CPUMatrix<T> vr(at(r, lo), 1, n);
+        CPUContext<T>::sub(va, vb, vr);
+      })) {
+        CPUContext<T>::sub(a, b, r);
+      }
+    }
+
+    void
+    add(const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (!same(a, r) || !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vr(at(r, lo), 1, n);
+        CPUContext<T>::add(va, vr);
+      })) {
+        CPUContext<T>::add(a, r);
+      }
+    }
+
+    void
+    sub(const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (!same(a, r) || !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vr(at(r, lo), 1, n);
+        CPUContext<T>::sub(va, vr);
+      })) {
+        CPUContext<T>::sub(a, r);
+      }
+    }
+
+    void
+    scale(T s, CPUMatrix<T>& r) const {
+      if (!ranges(r.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> vr(at(r, lo), 1, n);
+        CPUContext<T>::scale(s, vr);
+      })) {
+        CPUContext<T>::scale(s, r);
+      }
+    }
+
+    void
+    axpy(T s, const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (!same(a, r) || !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vr(at(r, lo), 1, n);
+        CPUContext<T>::axpy(s, va, vr);
+      })) {
+        CPUContext<T>::axpy(s, a, r);
+      }
+    }
+
+    // row blocks of r = alpha * op(a) * op(b) + beta * r
+    void
+    gemm(bool ta, bool tb, T alpha,
+    const CPUMatrix<T>& a, const CPUMatrix<T>& b, T beta,
+    CPUMatrix<T>& r) const {
+      std::size_t inner = ta ? a.rows() : a.cols();
+      std::size_t tasks = this->tasks(r.size() * inner, r.rows());
+      if (tasks < 2 || !this->gemm_shape(ta, tb, a, b, r)) {
+        CPUContext<T>::gemm(ta, tb, alpha, a, b, beta, r);
+        return;
+      }
+
+      _pool.run(tasks, [&](std::size_t i) {
+        std::size_t lo = r.rows() * i / tasks;
+        std::size_t n = r.rows() * (i + 1) / tasks - lo;
+        auto rb = r.middleRows(lo, n);
+        if (ta && tb) {
+          this->product(a.middleCols(lo, n).transpose(), b.transpose(),
+            alpha, beta, rb);
+        }
+        else if (ta) {
+          this->product(a.middleCols(lo, n).transpose(), b, alpha, beta, rb);
+        }
+        else if (tb) {
+          this->product(a.middleRows(lo, n), b.transpose(), alpha, beta, rb);
+        }
+        else {
+          this->product(a.middleRows(lo, n), b, alpha, beta, rb);
+        }
+      });
+    }
+
+    void
+    mul(const CPUMatrix<T>& a, T s, CPUMatrix<T>& r) const {
+      if (!same(a, r) || !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vr(at(r, lo), 1, n);
+        CPUContext<T>::mul(va, s, vr);
+      })) {
+        CPUContext<T>::mul(a, s, r);
+      }
+    }
+
+    void
+    mul(
+    const CPUMatrix<T>& a, const CPUMatrix<T>& b, CPUMatrix<T>& r) const {
+      if (!same(a, b) || !same(a, r) ||
+      !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vb(at(b, lo), 1, n);
+        CPUMatrix<T> vr(at(r, lo), 1, n);
+        CPUContext<T>::mul(va, vb, vr);
+      })) {
+        CPUContext<T>::mul(a, b, r);
+      }
+    }
+
+    void
+    exponent(const CPUMatrix<T>& a, CPUMatrix<T>& r) const {
+      if (!same(a, r) || !ranges(a.size(), [&](std::size_t lo, std::size_t n) {
+        CPUMatrix<T> va(at(a, lo), 1, n), vr(at(r, lo), 1, n);
+        CPUContext<T>::exponent(va, vr);
+      })) {
+        CPUContext<T>::exponent(a, r);
+      }
+    }
+
+    // partial sums are added in range order, so the result does not depend
+    // on thread timing
+    T
+    summation(const CPUMatrix<T>& a) const {
+      std::size_t size = a.size();
+      std::size_t tasks = this->tasks(size, size / ALIGNED);
+      if (tasks < 2) {
+        return CPUContext<T>::summation(a);
+      }
+
+      std::vector<T> partial(tasks);
+      _pool.run(tasks, [&](std::size_t i) {
+        std::size_t lo = bound(size, i, tasks);
+        CPUMatrix<T> va(at(a, lo), 1, bound(size, i + 1, tasks) - lo);
+        partial[i] = CPUContext<T>::summation(va);
+      });
+
+      T sum = 0;
+      for (auto p: partial) {
+        sum += p;
+      }
+      return sum;
+    }
+
+    // row blocks or column ranges reduced on the pool, each output value
+    // is reduced by one thread in the serial order
+    void
+    reduce(ReduceOp op, ReduceAxis axis, const CPUMatrix<T>& a,
+    CPUMatrix<T>& r) const {
+      std::size_t n = (axis == AXIS_ROWS) ? a.rows() : a.cols();
+      std::size_t tasks = this->tasks(a.size(), n);
+      if (tasks < 2 || !this->reduce_shape(axis, a, r)) {
+        CPUContext<T>::reduce(op, axis, a, r);
+        return;
+      }
+
+      _pool.run(tasks, [&](std::size_t i) {
+        std::size_t lo = n * i / tasks;
+        std::size_t hi = n * (i + 1) / tasks;
+        if (axis == AXIS_ROWS) {
+          Reducer<T>::reduce(op, axis, at(a, lo * a.cols()), hi - lo,
+            a.cols(), a.cols(), at(r, lo));
+        }
+        else {
+          Reducer<T>::reduce(op, axis, at(a, lo), a.rows(), hi - lo,
+            a.cols(), at(r, lo));
+        }
+      });
+    }
+
+  private:
+    // elements per 64 byte boundary that range views start at
+    static const std::size_t ALIGNED = (sizeof(T) < 64) ? 64 / sizeof(T) : 1;
+
+    // number of tasks to split work into, at most limit
+    std::size_t tasks(std::size_t work, std::size_t limit) const {
+      return std::min(std::min(_pool.size(), work / _threshold), limit);
+    }
+
+    // start of range i of tasks over size elements
+    static std::size_t
+    bound(std::size_t size, std::size_t i, std::size_t tasks) {
+      return (i == tasks) ? size : size * i / tasks / ALIGNED * ALIGNED;
+    }
+
+    // run f(lo, n) over contiguous element ranges [lo, lo + n) on the pool,
+    // false if size is too small to split
+    template <typename F>
+    bool ranges(std::size_t size, F f) const {
+      std::size_t tasks = this->tasks(size, size / ALIGNED);
+      if (tasks < 2) {
+        return false;
+      }
+      _pool.run(tasks, [&](std::size_t i) {
+        std::size_t lo = bound(size, i, tasks);
+        f(lo, bound(size, i + 1, tasks) - lo);
+      });
+      return true;
+    }
+
+    static bool same(const CPUMatrix<T>& a, const CPUMatrix<T>& b) {
+      return a.rows() == b.rows() && a.cols() == b.cols();
+    }
+
+    // element pointer for a range view, views of const operands are
+    // only read through
+    static T* at(const CPUMatrix<T>& a, std::size_t lo) {
+      return const_cast<T*>(a.data()) + lo;
+    }
+
+    mutable ThreadPool _pool;
+    std::size_t _threshold;
+};
+
+#endif /*_DL_PARALLEL_H_*/
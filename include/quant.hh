@@ -0,0 +1,444 @@
+#ifndef _DL_QUANT_H_
+#define _DL_QUANT_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "cpu.hh"
+
+// CPU implementation with int8 storage for forward inference
+
+// scale granularity of quantized matrices
+enum QuantScale {
+  QUANT_TENSOR,  // one scale per matrix
+  QUANT_ROW,     // one scale per row
+};
+
+// int8 matrix buffer with room for capacity elements and the scales that
+// map it to T, a default constructed matrix is an empty view owning no
+// storage
+template<typename T>
+class QuantMatrix {
+  public:
+    typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      Dense;
+
+    QuantMatrix() {
+      _data = NULL;
+      _rows = _cols = 0;
+      _capacity = 0;
+      _mapped = 0;
+      _mode = QUANT_ROW;
+    }
+
+    QuantMatrix(std::size_t rows, std::size_t cols, std::size_t capacity,
+    const CPUAllocator& allocator, QuantScale mode) {
+      _data = NULL;
+      _rows = rows;
+      _cols = cols;
+      _capacity = capacity;
+      _mapped = 0;
+      _mode = mode;
+      if (capacity > 0) {
+        _data = static_cast<std::int8_t*>(
+          allocator.allocate(capacity, _mapped));
+      }
+    }
+
+    QuantMatrix(const QuantMatrix& m) = delete;
+
+    // copy values of the same shape, calibrated ranges are not copied
+    QuantMatrix& operator=(const QuantMatrix& m) {
+      Dense v;
+      m.decode(v);
+      encode(v, false);
+      return *this;
+    }
+
+    ~QuantMatrix() {
+      if (_capacity > 0) {
+        CPUAllocator::deallocate(_data, _mapped);
+      }
+    }
+
+    std::size_t rows() const { return _rows; }
+    std::size_t cols() const { return _cols; }
+    std::size_t size() const { return _rows * _cols; }
+    std::size_t capacity() const { return _capacity; }
+    QuantScale mode() const { return _mode; }
+    const std::int8_t* data() const { return _data; }
+    std::int8_t* data() { return _data; }
+
+    // scale of a row
+    T scale(std::size_t row) const {
+      return _scales[(_mode == QUANT_ROW) ? row : 0];
+    }
+
+    // decode to T
+    void decode(Dense& r) const {
+      r.resize(_rows, _cols);
+      for (std::size_t i=0; i<_rows; i++) {
+        T s = scale(i);
+        for (std::size_t j=0; j<_cols; j++) {
+          r(i, j) = _data[i * _cols + j] * s;
+        }
+      }
+    }
+
+    // encode values of the same shape, scales come from the calibrated
+    // range if there is one and from the values otherwise, a calibration
+    // run widens the range to the values instead
+    void encode(const Dense& v, bool calibrate) {
+      std::size_t groups = (_mode == QUANT_ROW) ? _rows : 1;
+      std::size_t span = size() / std::max<std::size_t>(groups, 1);
+      _scales.resize(groups);
+      _ranges.resize(groups, 0);
+
+      for (std::size_t g=0; g<groups; g++) {
+        const T* x = v.data() + g * span;
+        T range = 0;
+        for (std::size_t i=0; i<span; i++) {
+          range = std::max<T>(range, std::abs(x[i]));
+        }
+        if (calibrate) {
+          _ranges[g] = std::max(_ranges[g], range);
+        }
+        else if (_ranges[g] > 0) {
+          range = _ranges[g];
+        }
+
+        T s = (range > 0) ? range / 127 : 1;
+        _scales[g] = s;
+        std::int8_t* q = _data + g * span;
+        for (std::size_t i=0; i<span; i++) {
+          q[i] = quantize(x[i] / s);
+        }
+      }
+    }
+
+    // remap the buffer to a new shape within capacity, the buffer takes
+    // a new role so the calibrated ranges are dropped
+    void reshape(std::size_t rows, std::size_t cols) {
+      _rows = rows;
+      _cols = cols;
+      _ranges.clear();
+    }
+
+    // remap a view to external storage
+    void rebind(std::int8_t* data, std::size_t rows, std::size_t cols,
+    QuantScale mode) {
+      _data = data;
+      _rows = rows;
+      _cols = cols;
+      _mode = mode;
+      _ranges.clear();
+    }
+
+    // round and saturate to the symmetric int8 range
+    static std::int8_t quantize(T x) {
+      x = std::round(x);
+      return (std::int8_t)std::max<T>(-127, std::min<T>(127, x));
+    }
+
+  private:
+    std::int8_t* _data;
+    std::size_t _rows;
+    std::size_t _cols;
+    std::size_t _capacity;
+    std::size_t _mapped;
+    QuantScale _mode;
+    std::vector<T> _scales;
+    std::vector<T> _ranges;
+};
+
+// Products multiply int8 values with int32 accumulation, other ops decode
+// to T and requantize the result. The context is meant for forward passes,
+// gradients lose too much precision in int8.
+template<typename T>
+class QuantContext : public Context<T, QuantMatrix> {
+  public:
+    typedef typename QuantMatrix<T>::Dense Dense;
+
+    explicit QuantContext(QuantScale mode = QUANT_ROW) {
+      _mode = mode;
+      _calibrating = false;
+    }
+
+    // scale granularity of matrices created by this context
+    QuantScale get_mode() const {
+      return _mode;
+    }
+
+    // record the value range of every result until end_calibration,
+    // run forward over sample inputs in between, later results are
+    // quantized with the recorded ranges and saturate outside them
+    void begin_calibration() {
+      _calibrating = true;
+    }
+
+    void end_calibration() {
+      _calibrating = false;
+    }
+
+    QuantMatrix<T>*
+    create(std::size_t rows, std::size_t cols, std::size_t capacity) const {
+      return new QuantMatrix<T>(rows, cols, capacity, _allocator, _mode);
+    }
+
+    std::size_t
+    capacity(const QuantMatrix<T>& a) const {
+      return a.capacity();
+    }
+
+    std::size_t
+    element_bytes() const {
+      return sizeof(std::int8_t);
+    }
+
+    void
+    reshape(QuantMatrix<T>& a, std::size_t rows, std::size_t cols) const {
+      if (rows * cols <= a.capacity()) {
+        a.reshape(rows, cols);
+      }
+      else {
+        this->on_error("matrix reshape exceeds capacity");
+      }
+    }
+
+    void
+    view(QuantMatrix<T>& r, QuantMatrix<T>& region, std::size_t offset,
+    std::size_t rows, std::size_t cols) const {
+      r.rebind(region.data() + offset, rows, cols, region.mode());
+    }
+
+    std::size_t
+    rows(const QuantMatrix<T>& a) const {
+      return a.rows();
+    }
+
+    std::size_t
+    cols(const QuantMatrix<T>& a) const {
+      return a.cols();
+    }
+
+    void
+    set(QuantMatrix<T>& r, const std::vector<T>& s) const {
+      r.encode(Eigen::Map<const Dense>(s.data(), r.rows(), r.cols()),
+        _calibrating);
+    }
+
+    void
+    get(const QuantMatrix<T>& s, std::vector<T>& r) const {
+      Dense v;
+      s.decode(v);
+      r.assign(v.data(), v.data() + v.size());
+    }
+
+    void
+    set(QuantMatrix<T>& r, T v) const {
+      r.encode(Dense::Constant(r.rows(), r.cols(), v), _calibrating);
+    }
+
+    void
+    add(const QuantMatrix<T>& a, const QuantMatrix<T>& b, QuantMatrix<T>& r)
+    const {
+      if (a.rows() == b.rows() && a.cols() == b.cols()) {
+        Dense da, db;
+        a.decode(da);
+        b.decode(db);
+        r.encode(da + db, _calibrating);
+      }
+      else {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+    }
+
+    void
+    sub(const QuantMatrix<T>& a, const QuantMatrix<T>& b, QuantMatrix<T>& r)
+    const {
+      if (a.rows() == b.rows() && a.cols() == b.cols()) {
+        Dense da, db;
+        a.decode(da);
+        b.decode(db);
+        r.encode(da - db, _calibrating);
+      }
+      else {
+        this->on_error("dimension mismatch in matrix subtracion");
+      }
+    }
+
+    void
+    add(const QuantMatrix<T>& a, QuantMatrix<T>& r) const {
+      add(r, a, r);
+    }
+
+    void
+    sub(const QuantMatrix<T>& a, QuantMatrix<T>& r) const {
+      sub(r, a, r);
+    }
+
+    void
+    scale(T s, QuantMatrix<T>& r) const {
+      mul(r, s, r);
+    }
+
+    void
+    axpy(T s, const QuantMatrix<T>& a, QuantMatrix<T>& r) const {
+      if (a.rows() == r.rows() && a.cols() == r.cols()) {
+        Dense da, dr;
+        a.decode(da);
+        r.decode(dr);
+        r.encode(dr + s * da, _calibrating);
+      }
+      else {
+        this->on_error("dimension mismatch in matrix axpy");
+      }
+    }
+
+    // int8 op(a) * op(b) with int32 accumulation, scaled back per row of
+    // op(a) and per column of op(b)
+    void
+    gemm(bool ta, bool tb, T alpha,
+    const QuantMatrix<T>& a, const QuantMatrix<T>& b, T beta,
+    QuantMatrix<T>& r) const {
+      std::size_t m = ta ? a.cols() : a.rows();
+      std::size_t k = ta ? a.rows() : a.cols();
+      std::size_t n = tb ? b.rows() : b.cols();
+      if (k != (tb ? b.cols() : b.rows()) || r.rows() != m || r.cols() != n) {
+        this->on_error("dimension mismatch in matrix-product multiplication");
+        return;
+      }
+
+      std::vector<std::int8_t> qa, qb;
+      std::vector<T> sa, sb;
+      operand(a, ta, true, qa, sa);
+      operand(b, tb, false, qb, sb);
+
+      Dense dr;
+      if (beta == 0) {
+        dr.resize(m, n);
+      }
+      else {
+        r.decode(dr);
+        dr *= beta;
+      }
+
+      std::vector<std::int32_t> acc(n);
+      for (std::size_t i=0; i<m; i++) {
+        std::fill(acc.begin(), acc.end(), 0);
+        for (std::size_t p=0; p<k; p++) {
+          std::int32_t x = qa[i * k + p];
+          const std::int8_t* y = qb.data() + p * n;
+          for (std::size_t j=0; j<n; j++) {
+            acc[j] += x * y[j];
+          }
+        }
+        T s = alpha * sa[i];
+        for (std::size_t j=0; j<n; j++) {
+          T v = s * sb[j] * acc[j];
+          dr(i, j) = (beta == 0) ? v : dr(i, j) + v;
+        }
+      }
+      r.encode(dr, _calibrating);
+    }
+
+    void
+    mul(const QuantMatrix<T>& a, T s, QuantMatrix<T>& r) const {
+      Dense da;
+      a.decode(da);
+      r.encode(da * s, _calibrating);
+    }
+
+    void
+    mul(const QuantMatrix<T>& a, const QuantMatrix<T>& b, QuantMatrix<T>& r)
+    const {
+      if (a.cols() == b.cols() && a.rows() == b.rows()) {
+        Dense da, db;
+        a.decode(da);
+        b.decode(db);
+        r.encode(da.cwiseProduct(db), _calibrating);
+      }
+      else {
+        this->on_error("dimension mismatch in matrix-element multiplication");
+      }
+    }
+
+    void
+    exponent(const QuantMatrix<T>& a, QuantMatrix<T>& r) const {
+      Dense da;
+      a.decode(da);
+      r.encode(da.array().exp().matrix(), _calibrating);
+    }
+
+    void
+    transpose(const QuantMatrix<T>& a, QuantMatrix<T>& r) const {
+      Dense da;
+      a.decode(da);
+      r.encode(da.transpose(), _calibrating);
+    }
+
+    // row sums accumulate in int32 before scaling
+    T
+    summation(const QuantMatrix<T>& a) const {
+      T sum = 0;
+      for (std::size_t i=0; i<a.rows(); i++) {
+        const std::int8_t* q = a.data() + i * a.cols();
+        std::int32_t row = 0;
+        for (std::size_t j=0; j<a.cols(); j++) {
+          row += q[j];
+        }
+        sum += a.scale(i) * row;
+      }
+      return sum;
+    }
+
+  private:
+    // int8 values of op(a) in row major order with scales s per row of
+    // op(a) for the left operand or per column for the right one, values
+    // are requantized when the scales of a vary along the inner dimension
+    static void operand(const QuantMatrix<T>& a, bool t, bool left,
+    std::vector<std::int8_t>& q, std::vector<T>& s) {
+      std::size_t rows = t ? a.cols() : a.rows();
+      std::size_t cols = t ? a.rows() : a.cols();
+      q.resize(rows * cols);
+      s.resize(left ? rows : cols);
+
+      if (a.mode() == QUANT_TENSOR || left != t) {
+        // a row of a maps to a row of a left or a column of a right op(a)
+        for (std::size_t i=0; i<a.rows(); i++) {
+          const std::int8_t* row = a.data() + i * a.cols();
+          for (std::size_t j=0; j<a.cols(); j++) {
+            q[t ? j * cols + i : i * cols + j] = row[j];
+          }
+        }
+        for (std::size_t i=0; i<s.size(); i++) {
+          s[i] = a.scale((a.mode() == QUANT_TENSOR) ? 0 : i);
+        }
+        return;
+      }
+
+      Dense da;
+      a.decode(da);
+      if (t) {
+        da.transposeInPlace();
+      }
+      for (std::size_t g=0; g<s.size(); g++) {
+        T range = left ? da.row(g).cwiseAbs().maxCoeff() :
+          da.col(g).cwiseAbs().maxCoeff();
+        s[g] = (range > 0) ? range / 127 : 1;
+      }
+      for (std::size_t i=0; i<rows; i++) {
+        for (std::size_t j=0; j<cols; j++) {
+          q[i * cols + j] =
+            QuantMatrix<T>::quantize(da(i, j) / s[left ? i : j]);
+        }
+      }
+    }
+
+    QuantScale _mode;
+    bool _calibrating;
+    CPUAllocator _allocator;
+};
+
+#endif /*_DL_QUANT_H_*/
@@ -0,0 +1,172 @@
+#ifndef _DL_REDUCE_H_
+#define _DL_REDUCE_H_
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Numerically stable row and column reductions
+
+// reduction ops
+enum ReduceOp {
+  REDUCE_SUM,
+  REDUCE_MEAN,
+  REDUCE_MAX,
+  REDUCE_LOGSUMEXP,
+};
+
+// reduction axes
+enum ReduceAxis {
+  AXIS_ROWS,  // one value per row, a rows x 1 result
+  AXIS_COLS,  // one value per column, a 1 x cols result
+};
+
+// reduction kernels over a row major rows x cols block with leading
+// dimension ld, sums are pairwise over leaves of up to BLOCK terms so the
+// rounding error grows with log n instead of n
+template <typename T>
+struct Reducer {
+  static const std::size_t BLOCK = 128;
+
+  // pairwise sum of leaf(lo, n) over [lo, lo + n) split in leaves of up
+  // to block terms, split points stay on block multiples
+  template <typename F>
+  static T pairwise(std::size_t lo, std::size_t n, std::size_t block,
+  const F& leaf) {
+    if (n <= block) {
+      return leaf(lo, n);
+    }
+    std::size_t h = (n / 2 + block - 1) / block * block;
+    return pairwise(lo, h, block, leaf) + pairwise(lo + h, n - h, block, leaf);
+  }
+
+  // sum of f(x[i]) over n terms with independent accumulators
+  template <typename F>
+  static T leaf(const T* x, std::size_t n, const F& f) {
+    T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    const T* end = x + n;
+    for (; end - x >= 4; x += 4) {
+      s0 += f(x[0]);
+      s1 += f(x[1]);
+      s2 += f(x[2]);
+      s3 += f(x[3]);
+    }
+    for (; x < end; x++) {
+      s0 += f(*x);
+    }
+    return (s0 + s1) + (s2 + s3);
+  }
+
+  // pairwise sum of f(x[i]) over n terms
+  template <typename F>
+  static T sum(const T* x, std::size_t n, const F& f) {
+    return pairwise(0, n, BLOCK, [&](std::size_t lo, std::size_t k) {
+      return leaf(x + lo, k, f);
+    });
+  }
+
+  static T max(const T* x, std::size_t n) {
+    T m = -std::numeric_limits<T>::infinity();
+    for (std::size_t i=0; i<n; i++) {
+      m = (x[i] > m || x[i] != x[i]) ? x[i] : m;
+    }
+    return m;
+  }
+
+  // log(sum(exp(x))) shifted by the max, inf and NaN maxima pass through
+  static T logsumexp(const T* x, std::size_t n) {
+    T m = max(x, n);
+    if (!std::isfinite(m)) {
+      return m;
+    }
+    return m + std::log(sum(x, n, [m](T v) { return std::exp(v - m); }));
+  }
+
+  // r[j] = sum of f(a[i][j], j) over rows, pairwise over row blocks
+  template <typename F>
+  static void cols_sum(const T* a, std::size_t rows, std::size_t cols,
+  std::size_t ld, const F& f, T* r) {
+    if (rows <= BLOCK) {
+      for (std::size_t j=0; j<cols; j++) {
+        r[j] = 0;
+      }
+      for (std::size_t i=0; i<rows; i++) {
+        const T* x = a + i * ld;
+        for (std::size_t j=0; j<cols; j++) {
+          r[j] += f(x[j], j);
+        }
+      }
+      return;
+    }
+    std::size_t h = (rows / 2 + BLOCK - 1) / BLOCK * BLOCK;
+    std::vector<T> t(cols);
+    cols_sum(a, h, cols, ld, f, r);
+    cols_sum(a + h * ld, rows - h, cols, ld, f, t.data());
+    for (std::size_t j=0; j<cols; j++) {
+      r[j] += t[j];
+    }
+  }
+
+  static void cols_max(const T* a, std::size_t rows, std::size_t cols,
+  std::size_t ld, T* r) {
+    for (std::size_t j=0; j<cols; j++) {
+      r[j] = -std::numeric_limits<T>::infinity();
+    }
+    for (std::size_t i=0; i<rows; i++) {
+      const T* x = a + i * ld;
+      for (std::size_t j=0; j<cols; j++) {
+        r[j] = (x[j] > r[j] || x[j] != x[j]) ? x[j] : r[j];
+      }
+    }
+  }
+
+  // r = op over each row of a into rows values or over each column into
+  // cols values
+  static void reduce(ReduceOp op, ReduceAxis axis, const T* a,
+  std::size_t rows, std::size_t cols, std::size_t ld, T* r) {
+    if (axis == AXIS_ROWS) {
+      for (std::size_t i=0; i<rows; i++) {
+        r[i] = row(op, a + i * ld, cols);
+      }
+      return;
+    }
+
+    if (op == REDUCE_SUM || op == REDUCE_MEAN) {
+      T s = (op == REDUCE_MEAN) ? T(1) / rows : T(1);
+      cols_sum(a, rows, cols, ld, [](T v, std::size_t) { return v; }, r);
+      for (std::size_t j=0; j<cols; j++) {
+        r[j] *= s;
+      }
+    }
+    else if (op == REDUCE_MAX) {
+      cols_max(a, rows, cols, ld, r);
+    }
+    else {
+      std::vector<T> m(cols);
+      cols_max(a, rows, cols, ld, m.data());
+      cols_sum(a, rows, cols, ld, [&m](T v, std::size_t j) {
+        return std::isfinite(m[j]) ? std::exp(v - m[j]) : T(1);
+      }, r);
+      for (std::size_t j=0; j<cols; j++) {
+        r[j] = std::isfinite(m[j]) ? m[j] + std::log(r[j]) : m[j];
+      }
+    }
+  }
+
+  // op over one row of n values
+  static T row(ReduceOp op, const T* x, std::size_t n) {
+    switch (op) {
+      case REDUCE_SUM:
+        return sum(x, n, [](T v) { return v; });
+      case REDUCE_MEAN:
+        return sum(x, n, [](T v) { return v; }) / n;
+      case REDUCE_MAX:
+        return max(x, n);
+      default:
+        return logsumexp(x, n);
+    }
+  }
+};
+
+#endif /*_DL_REDUCE_H_*/
@@ -0,0 +1,253 @@
+#ifndef _DL_SIMD_H_
+#define _DL_SIMD_H_
+
+#include <cstddef>
+#include <cstring>
+
+// Element-wise CPU kernels with runtime instruction set dispatch
+
+#define DL_SIMD_INLINE inline __attribute__((always_inline))
+
+// instruction set levels, in order of vector width
+enum SIMDLevel {
+  SIMD_NONE,
+  SIMD_SSE4,
+  SIMD_AVX2,
+  SIMD_AVX512,
+};
+
+// kernel bodies over GCC vector type V of floats and I of ints, inlined
+// into a target specific wrapper so V compiles to that instruction set
+template <typename V, typename I>
+struct SIMDKernels {
+  static const std::size_t N = sizeof(V) / sizeof(float);
+
+  static DL_SIMD_INLINE void
+  add(const float* a, const float* b, float* r, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+      V x, y;
+      std::memcpy(&x, a + i, sizeof(V));
+      std::memcpy(&y, b + i, sizeof(V));
+      x += y;
+      std::memcpy(r + i, &x, sizeof(V));
+    }
+    for (; i < n; i++) {
+      r[i] = a[i] + b[i];
+    }
+  }
+
+  static DL_SIMD_INLINE void
+  sub(const float* a, const float* b, float* r, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+      V x, y;
+      std::memcpy(&x, a + i, sizeof(V));
+      std::memcpy(&y, b + i, sizeof(V));
+      x -= y;
+      std::memcpy(r + i, &x, sizeof(V));
+    }
+    for (; i < n; i++) {
+      r[i] = a[i] - b[i];
+    }
+  }
+
+  static DL_SIMD_INLINE void
+  mul(const float* a, const float* b, float* r, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+      V x, y;
+      std::memcpy(&x, a + i, sizeof(V));
+      std::memcpy(&y, b + i, sizeof(V));
+      x *= y;
+      std::memcpy(r + i, &x, sizeof(V));
+    }
+    for (; i < n; i++) {
+      r[i] = a[i] * b[i];
+    }
+  }
+
+  // cephes style exp, overflows to inf above 88.37 and flushes to 0 below
+  // -88.37, the tail runs through the same vector code for identical results
+  static DL_SIMD_INLINE void
+  exp(const float* a, float* r, std::size_t n) {
+    std::size_t i = 0;
+    for (; i + N <= n; i += N) {
+      V x;
+      std::memcpy(&x, a + i, sizeof(V));
+      exp(x);
+      std::memcpy(r + i, &x, sizeof(V));
+    }
+    if (i < n) {
+      V x = {};
+      std::memcpy(&x, a + i, (n - i) * sizeof(float));
+      exp(x);
+      std::memcpy(r + i, &x, (n - i) * sizeof(float));
+    }
+  }
+
+  // exp of x in place, vectors pass by reference to keep the ABI
+  static DL_SIMD_INLINE void
+  exp(V& x) {
+    I inf = x > 88.3762626647949f;
+
+    // clamp, NaN passes through
+    x = x > 88.3762626647949f ? 88.3762626647949f : x;
+    x = x < -88.3762626647949f ? -88.3762626647949f : x;
+
+    // exp(x) = 2^t * exp(g), t = floor(x * log2(e) + 1/2)
+    V fx = x * 1.44269504088896341f + 0.5f;
+    I t = __builtin_convertvector(fx, I);
+    t += (__builtin_convertvector(t, V) > fx);
+    fx = __builtin_convertvector(t, V);
+    x = x - fx * 0.693359375f - fx * -2.12194440e-4f;
+
+    V y = 1.9875691500e-4f * x + 1.3981999507e-3f;
+    y = y * x + 8.3334519073e-3f;
+    y = y * x + 4.1665795894e-2f;
+    y = y * x + 1.6666665459e-1f;
+    y = y * x + 5.0000001201e-1f;
+    y = y * (x * x) + x + 1.0f;
+
+    I e = (t + 127) << 23;
+    y *= (V)e;
+    x = inf ? __builtin_inff() : y;
+  }
+
+  static DL_SIMD_INLINE float
+  sum(const float* a, std::size_t n) {
+    // independent accumulators hide the add latency
+    V s0 = {}, s1 = {}, s2 = {}, s3 = {};
+    std::size_t i = 0;
+    for (; i + 4 * N <= n; i += 4 * N) {
+      V x0, x1, x2, x3;
+      std::memcpy(&x0, a + i, sizeof(V));
+      std::memcpy(&x1, a + i + N, sizeof(V));
+      std::memcpy(&x2, a + i + 2 * N, sizeof(V));
+      std::memcpy(&x3, a + i + 3 * N, sizeof(V));
+      s0 += x0;
+      s1 += x1;
+      s2 += x2;
+      s3 += x3;
+    }
+    for (; i + N <= n; i += N) {
+      V x;
+      std::memcpy(&x, a + i, sizeof(V));
+      s0 += x;
+    }
+    s0 += s1 + s2 + s3;
+
+    float s = 0;
+    for (std::size_t k = 0; k < N; k++) {
+      s += s0[k];
+    }
+    for (; i < n; i++) {
+      s += a[i];
+    }
+    return s;
+  }
+};
+
+// kernel wrappers compiled for one instruction set
+#define DL_SIMD_TARGET(NAME, TARGET, WIDTH) \
+struct NAME { \
+  typedef float V __attribute__((vector_size(WIDTH))); \
+  typedef int I __attribute__((vector_size(WIDTH))); \
+  typedef SIMDKernels<V,I> K; \
+  __attribute__((target(TARGET))) static void \
+  add(const float* a, const float* b, float* r, std::size_t n) { \
+    K::add(a, b, r, n); \
+  } \
+  __attribute__((target(TARGET))) static void \
+  sub(const float* a, const float* b, float* r, std::size_t n) { \
+    K::sub(a, b, r, n); \
+  } \
+  __attribute__((target(TARGET))) static void \
+  mul(const float* a, const float* b, float* r, std::size_t n) { \
+    K::mul(a, b, r, n); \
+  } \
+  __attribute__((target(TARGET))) static void \
+  exp(const float* a, float* r, std::size_t n) { \
+    K::exp(a, r, n); \
+  } \
+  __attribute__((target(TARGET))) static float \
+  sum(const float* a, std::size_t n) { \
+    return K::sum(a, n); \
+  } \
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+DL_SIMD_TARGET(SIMDSSE4, "sse4.1", 16)
+DL_SIMD_TARGET(SIMDAVX2, "avx2,fma", 32)
+DL_SIMD_TARGET(SIMDAVX512, "avx512f", 64)
+#endif
+
+// kernel table of one instruction set, null kernels mean no SIMD support
+// for T and the caller falls back to its own implementation
+template <class T>
+struct SIMD {
+  typedef void (*Binary)(const T* a, const T* b, T* r, std::size_t n);
+  typedef void (*Unary)(const T* a, T* r, std::size_t n);
+  typedef T (*Reduce)(const T* a, std::size_t n);
+
+  SIMDLevel level;
+  Binary add;
+  Binary sub;
+  Binary mul;
+  Unary exp;
+  Reduce sum;
+
+  // best instruction set supported by the host cpu
+  static SIMDLevel host() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+      return SIMD_SSE4;
+    }
+#endif
+    return SIMD_NONE;
+  }
+
+  // kernels of the best instruction set up to max supported by the host
+  static SIMD get(SIMDLevel max = SIMD_AVX512) {
+    SIMD s = { SIMD_NONE, NULL, NULL, NULL, NULL, NULL };
+    return s;
+  }
+};
+
+template <>
+inline SIMD<float> SIMD<float>::get(SIMDLevel max) {
+  SIMDLevel level = host();
+  if (max < level) {
+    level = max;
+  }
+
+  SIMD s = { SIMD_NONE, NULL, NULL, NULL, NULL, NULL };
+  switch (level) {
+#if defined(__x86_64__) || defined(__i386__)
+    case SIMD_AVX512:
+      s = { level, SIMDAVX512::add, SIMDAVX512::sub, SIMDAVX512::mul,
+        SIMDAVX512::exp, SIMDAVX512::sum };
+      break;
+    case SIMD_AVX2:
+      s = { level, SIMDAVX2::add, SIMDAVX2::sub, SIMDAVX2::mul,
+        SIMDAVX2::exp, SIMDAVX2::sum };
+      break;
+    case SIMD_SSE4:
+      s = { level, SIMDSSE4::add, SIMDSSE4::sub, SIMDSSE4::mul,
+        SIMDSSE4::exp, SIMDSSE4::sum };
+      break;
+#endif
+    default:
+      break;
+  }
+  return s;
+}
+
+#endif /*_DL_SIMD_H_*/
@@ -0,0 +1,428 @@
+#ifndef _DL_SPARSE_H_
+#define _DL_SPARSE_H_
+
+#include <eigen3/Eigen/Sparse>
+
+#include "cpu.hh"
+
+// CPU implementation with optional CSR storage for sparse values
+
+// dense CPU matrix buffer that may hold its values in CSR form instead,
+// the dense buffer is then left untouched and its pages are never faulted
+// in for large matrices
+template<typename T>
+class SparseCPUMatrix : public CPUMatrix<T> {
+  public:
+    typedef CPUMatrix<T> Base;
+    typedef Eigen::SparseMatrix<T, Eigen::RowMajor> CSR;
+    typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      Dense;
+
+    SparseCPUMatrix() {
+      _sparse = false;
+    }
+
+    SparseCPUMatrix(std::size_t rows, std::size_t cols, std::size_t capacity,
+    const CPUAllocator& allocator) : Base(rows, cols, capacity, allocator) {
+      _sparse = false;
+    }
+
+    SparseCPUMatrix(const SparseCPUMatrix& m) = delete;
+
+    // copy values of the same shape, sparse values stay sparse
+    SparseCPUMatrix& operator=(const SparseCPUMatrix& m) {
+      if (m._sparse) {
+        set_csr(m._csr);
+      }
+      else {
+        Base::operator=(m);
+        discard();
+      }
+      return *this;
+    }
+
+    // values are held in CSR form
+    bool sparse() const {
+      return _sparse;
+    }
+
+    const CSR& csr() const {
+      return _csr;
+    }
+
+    CSR& csr() {
+      return _csr;
+    }
+
+    // hold values of the same shape in CSR form
+    void set_csr(const CSR& s) {
+      _csr = s;
+      _sparse = true;
+    }
+
+    // hold values of the same shape in the dense buffer
+    void set_dense(const Dense& d) {
+      Base::Base::operator=(d);
+      discard();
+    }
+
+    // move dense values into CSR form, zeros are dropped
+    void sparsify() {
+      if (!_sparse) {
+        _csr = static_cast<const typename Base::Base&>(*this).sparseView();
+        _sparse = true;
+      }
+    }
+
+    // move CSR values into the dense buffer
+    void densify() {
+      if (_sparse) {
+        Base::Base::operator=(_csr.toDense());
+        discard();
+      }
+    }
+
+    // drop the CSR form, the dense buffer is about to be overwritten
+    void discard() {
+      if (_sparse) {
+        _csr = CSR();
+        _sparse = false;
+      }
+    }
+
+    // remap the buffer to a new shape within capacity
+    void reshape(std::size_t rows, std::size_t cols) {
+      Base::reshape(rows, cols);
+      discard();
+    }
+
+    // remap a view to external storage
+    void rebind(T* data, std::size_t rows, std::size_t cols) {
+      Base::rebind(data, rows, cols);
+      discard();
+    }
+
+  private:
+    CSR _csr;
+    bool _sparse;
+};
+
+// Ops with only dense operands run on the dense CPU context. Sparse
+// operands cost O(nnz) in products, element multiply and accumulation
+// into dense matrices, results stay sparse where zeros are preserved.
+template<typename T>
+class SparseCPUContext : public Context<T, SparseCPUMatrix> {
+  public:
+    typedef SparseCPUMatrix<T> Sparse;
+    typedef typename Sparse::CSR CSR;
+    typedef typename Sparse::Dense Dense;
+
+    // move values of a into CSR form
+    void sparsify(Sparse& a) const {
+      a.sparsify();
+    }
+
+    // move values of a into the dense buffer
+    void densify(Sparse& a) const {
+      a.densify();
+    }
+
+    // set CSR values from (row, col, value) triplets, duplicates are summed
+    void
+    set_sparse(Sparse& r, const std::vector<Eigen::Triplet<T>>& s) const {
+      CSR c(r.rows(), r.cols());
+      c.setFromTriplets(s.begin(), s.end());
+      r.set_csr(c);
+    }
+
+    Sparse*
+    create(std::size_t rows, std::size_t cols, std::size_t capacity) const {
+      return new Sparse(rows, cols, capacity, _allocator);
+    }
+
+    std::size_t
+    capacity(const Sparse& a) const {
+      return a.capacity();
+    }
+
+    void
+    reshape(Sparse& a, std::size_t rows, std::size_t cols) const {
+      if (rows * cols <= a.capacity()) {
+        a.reshape(rows, cols);
+      }
+      else {
+        this->on_error("matrix reshape exceeds capacity");
+      }
+    }
+
+    void
+    view(Sparse& r, Sparse& region, std::size_t offset,
+    std::size_t rows, std::size_t cols) const {
+      r.rebind(region.data() + offset, rows, cols);
+    }
+
+    std::size_t
+    rows(const Sparse& a) const {
+      return a.rows();
+    }
+
+    std::size_t
+    cols(const Sparse& a) const {
+      return a.cols();
+    }
+
+    void
+    set(Sparse& r, const std::vector<T>& s) const {
+      r.discard();
+      _dense.set(r, s);
+    }
+
+    void
+    get(const Sparse& s, std::vector<T>& r) const {
+      if (s.sparse()) {
+        Dense d = s.csr();
+        r.assign(d.data(), d.data() + d.size());
+      }
+      else {
+        _dense.get(s, r);
+      }
+    }
+
+    void
+    set(Sparse& r, T v) const {
+      r.discard();
+      _dense.set(r, v);
+    }
+
+    void
+    add(const Sparse& a, const Sparse& b, Sparse& r) const {
+      if (!same(a, b)) {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+      else if (a.sparse() || b.sparse()) {
+        combine(a, 1, b, r);
+      }
+      else {
+        r.discard();
+        _dense.add(a, b, r);
+      }
+    }
+
+    void
+    sub(const Sparse& a, const Sparse& b, Sparse& r) const {
+      if (!same(a, b)) {
+        this->on_error("dimension mismatch in matrix subtracion");
+      }
+      else if (a.sparse() || b.sparse()) {
+        combine(a, -1, b, r);
+      }
+      else {
+        r.discard();
+        _dense.sub(a, b, r);
+      }
+    }
+
+    void
+    add(const Sparse& a, Sparse& r) const {
+      if (!same(a, r)) {
+        this->on_error("dimension mismatch in matrix addition");
+      }
+      else if (a.sparse() || r.sparse()) {
+        combine(r, 1, a, r);
+      }
+      else {
+        _dense.add(a, r);
+      }
+    }
+
+    void
+    sub(const Sparse& a, Sparse& r) const {
+      if (!same(a, r)) {
+        this->on_error("dimension mismatch in matrix subtracion");
+      }
+      else if (a.sparse() || r.sparse()) {
+        combine(r, -1, a, r);
+      }
+      else {
+        _dense.sub(a, r);
+      }
+    }
+
+    void
+    scale(T s, Sparse& r) const {
+      if (r.sparse()) {
+        r.csr() *= s;
+      }
+      else {
+        _dense.scale(s, r);
+      }
+    }
+
+    void
+    axpy(T s, const Sparse& a, Sparse& r) const {
+      if (!same(a, r)) {
+        this->on_error("dimension mismatch in matrix axpy");
+      }
+      else if (a.sparse() || r.sparse()) {
+        combine(r, s, a, r);
+      }
+      else {
+        _dense.axpy(s, a, r);
+      }
+    }
+
+    // products with a sparse operand have dense results
+    void
+    gemm(bool ta, bool tb, T alpha,
+    const Sparse& a, const Sparse& b, T beta, Sparse& r) const {
+      if ((ta ? a.rows() : a.cols()) != (tb ? b.cols() : b.rows()) ||
+      r.rows() != (ta ? a.cols() : a.rows()) ||
+      r.cols() != (tb ? b.rows() : b.cols())) {
+        this->on_error("dimension mismatch in matrix-product multiplication");
+        return;
+      }
+
+      if (beta == 0) {
+        r.discard();
+      }
+      else {
+        r.densify();
+      }
+
+      if (a.sparse() && ta) {
+        right(a.csr().transpose(), tb, b, alpha, beta, r);
+      }
+      else if (a.sparse()) {
+        right(a.csr(), tb, b, alpha, beta, r);
+      }
+      else if (b.sparse() && ta) {
+        right(a.transpose(), tb, b, alpha, beta, r);
+      }
+      else if (b.sparse()) {
+        right(a, tb, b, alpha, beta, r);
+      }
+      else {
+        _dense.gemm(ta, tb, alpha, a, b, beta, r);
+      }
+    }
+
+    void
+    mul(const Sparse& a, T s, Sparse& r) const {
+      if (a.sparse()) {
+        r.set_csr(a.csr() * s);
+      }
+      else {
+        r.discard();
+        _dense.mul(a, s, r);
+      }
+    }
+
+    // element multiply keeps the zeros of a sparse operand
+    void
+    mul(const Sparse& a, const Sparse& b, Sparse& r) const {
+      if (!same(a, b)) {
+        this->on_error("dimension mismatch in matrix-element multiplication");
+      }
+      else if (a.sparse() && b.sparse()) {
+        r.set_csr(a.csr().cwiseProduct(b.csr()));
+      }
+      else if (a.sparse()) {
+        r.set_csr(a.csr().cwiseProduct(b));
+      }
+      else if (b.sparse()) {
+        r.set_csr(b.csr().cwiseProduct(a));
+      }
+      else {
+        r.discard();
+        _dense.mul(a, b, r);
+      }
+    }
+
+    void
+    exponent(const Sparse& a, Sparse& r) const {
+      if (a.sparse()) {
+        Dense d = a.csr();
+        r.set_dense(d.array().exp().matrix());
+      }
+      else {
+        r.discard();
+        _dense.exponent(a, r);
+      }
+    }
+
+    void
+    transpose(const Sparse& a, Sparse& r) const {
+      if (a.sparse()) {
+        r.set_csr(a.csr().transpose());
+      }
+      else {
+        r.discard();
+        _dense.transpose(a, r);
+      }
+    }
+
+    T
+    summation(const Sparse& a) const {
+      return a.sparse() ? a.csr().sum() : _dense.summation(a);
+    }
+
+  private:
+    static bool same(const Sparse& a, const Sparse& b) {
+      return a.rows() == b.rows() && a.cols() == b.cols();
+    }
+
+    // r = a + s * b with a sparse operand, a dense a accumulated in place
+    // costs O(nnz) of b
+    static void combine(const Sparse& a, T s, const Sparse& b, Sparse& r) {
+      if (a.sparse() && b.sparse()) {
+        r.set_csr(a.csr() + s * b.csr());
+      }
+      else if (a.sparse()) {
+        Dense d = s * b;
+        d += a.csr();
+        r.set_dense(d);
+      }
+      else if (&a == &r) {
+        r += s * b.csr();
+      }
+      else {
+        Dense d = a;
+        d += s * b.csr();
+        r.set_dense(d);
+      }
+    }
+
+    // dispatch op(b) of a product with op(a) already chosen
+    template <typename X>
+    static void right(const X& x, bool tb, const Sparse& b,
+    T alpha, T beta, Sparse& r) {
+      if (b.sparse() && tb) {
+        product(x, b.csr().transpose(), alpha, beta, r);
+      }
+      else if (b.sparse()) {
+        product(x, b.csr(), alpha, beta, r);
+      }
+      else if (tb) {
+        product(x, b.transpose(), alpha, beta, r);
+      }
+      else {
+        product(x, b, alpha, beta, r);
+      }
+    }
+
+    // r = alpha * x * y + beta * r into a dense r
+    template <typename X, typename Y>
+    static void product(const X& x, const Y& y, T alpha, T beta, Sparse& r) {
+      Dense p = x * y;
+      p *= alpha;
+      if (beta != 0) {
+        p += beta * r;
+      }
+      r.set_dense(p);
+    }
+
+    CPUContext<T> _dense;
+    CPUAllocator _allocator;
+};
+
+#endif /*_DL_SPARSE_H_*/
@@ -0,0 +1,318 @@
+#ifndef _DL_THREADS_H_
+#define _DL_THREADS_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Thread pool and DAG scheduler shared by CPU contexts and runtimes
+
+///////////////////////////////////
+// fork-join thread pool
+///////////////////////////////////
+class ThreadPool {
+  public:
+    // pool of threads - 1 workers, the calling thread is the last one
+    explicit ThreadPool(std::size_t threads) {
+      _task = NULL;
+      _count = 0;
+      _next = 0;
+      _active = 0;
+      _generation = 0;
+      _stop = false;
+      for (std::size_t i=1; i<threads; i++) {
+        _workers.emplace_back(&ThreadPool::work, this);
+      }
+    }
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+      }
+      _start.notify_all();
+      for (auto& t: _workers) {
+        t.join();
+      }
+    }
+
+    // number of threads running tasks, including the caller
+    std::size_t size() const {
+      return _workers.size() + 1;
+    }
+
+    // run f(i) for i in [0, n) and return when all are done, runs serially
+    // if the pool is busy with another caller or a nested run
+    void run(std::size_t n, const std::function<void(std::size_t)>& f) {
+      // a nested run on the calling thread must not lock _busy again
+      auto& running = callers();
+      bool nested = std::find(running.begin(), running.end(), this) !=
+        running.end();
+      std::unique_lock<std::mutex> busy(_busy, std::defer_lock);
+      if (nested || _workers.empty() || !busy.try_lock()) {
+        for (std::size_t i=0; i<n; i++) {
+          f(i);
+        }
+        return;
+      }
+      Caller caller(this);
+
+      std::unique_lock<std::mutex> lock(_mutex);
+      _task = &f;
+      _count = n;
+      _next = 0;
+      _active = _workers.size();
+      _generation++;
+      lock.unlock();
+      _start.notify_all();
+
+      drain();
+
+      lock.lock();
+      _done.wait(lock, [this]() { return _active == 0; });
+      _task = NULL;
+    }
+
+  private:
+    // pools the calling thread runs tasks of as their caller
+    static std::vector<const ThreadPool*>& callers() {
+      static thread_local std::vector<const ThreadPool*> pools;
+      return pools;
+    }
+
+    // registers the calling thread as the caller of a run
+    struct Caller {
+      explicit Caller(const ThreadPool* pool) {
+        callers().push_back(pool);
+      }
+      ~Caller() {
+        callers().pop_back();
+      }
+    };
+
+    // take tasks until none are left
+    void drain() {
+      std::size_t i;
+      while ((i = _next++) < _count) {
+        (*_task)(i);
+      }
+    }
+
+    void work() {
+      std::uint64_t seen = 0;
+      std::unique_lock<std::mutex> lock(_mutex);
+      while (true) {
+        _start.wait(lock, [&]() { return _stop || _generation != seen; });
+        if (_stop) {
+          return;
+        }
+        seen = _generation;
+        lock.unlock();
+        drain();
+        lock.lock();
+        if (--_active == 0) {
+          _done.notify_one();
+        }
+      }
+    }
+
+    std::vector<std::thread> _workers;
+    std::mutex _busy;
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+
+    // current run
+    const std::function<void(std::size_t)>* _task;
+    std::size_t _count;
+    std::atomic<std::size_t> _next;
+    std::size_t _active;
+    std::uint64_t _generation;
+    bool _stop;
+};
+
+///////////////////////////////////
+// work-stealing DAG scheduler
+///////////////////////////////////
+class Scheduler {
+  public:
+    // scheduler on threads, the calling thread is the last one
+    explicit Scheduler(std::size_t threads) : _pool(threads) {}
+
+    // number of threads running nodes, including the caller
+    std::size_t size() const {
+      return _pool.size();
+    }
+
+    // run f(i) for nodes i of a DAG given the inputs of each node, a node
+    // runs once all its inputs are done, or once all its consumers are
+    // done if reverse; the first exception thrown by f is rethrown after
+    // the nodes already running are done
+    void run(const std::vector<std::vector<int>>& inputs, bool reverse,
+    const std::function<void(std::size_t)>& f) {
+      std::size_t n = inputs.size();
+      if (n == 0) {
+        return;
+      }
+
+      // pending dependency counts and the nodes each node releases
+      std::unique_ptr<std::atomic<int>[]> pending(new std::atomic<int>[n]);
+      std::vector<std::vector<int>> released(n);
+      for (std::size_t i=0; i<n; i++) {
+        pending[i] = 0;
+      }
+      for (std::size_t i=0; i<n; i++) {
+        for (auto j: inputs[i]) {
+          if (reverse) {
+            pending[j]++;
+            released[i].push_back(j);
+          }
+          else {
+            pending[i]++;
+            released[j].push_back(i);
+          }
+        }
+      }
+
+      // ready nodes are dealt round robin to the worker queues
+      std::size_t workers = _pool.size();
+      std::vector<Queue> queues(workers);
+      Idle idle;
+      for (std::size_t i=0, w=0; i<n; i++) {
+        if (pending[i] == 0) {
+          queues[w++ % workers].nodes.push_back(i);
+          idle.ready++;
+        }
+      }
+
+      std::atomic<std::size_t> remaining(n);
+      std::atomic<bool> failed(false);
+      std::exception_ptr error;
+      std::mutex error_lock;
+
+      _pool.run(workers, [&](std::size_t w) {
+        while (remaining > 0 && !failed) {
+          int i;
+          if (!take(queues, w, i)) {
+            idle.wait([&]() {
+              return remaining == 0 || failed || idle.ready > 0;
+            });
+            continue;
+          }
+          idle.ready--;
+          try {
+            f(i);
+          }
+          catch (...) {
+            std::lock_guard<std::mutex> guard(error_lock);
+            if (!failed) {
+              error = std::current_exception();
+              failed = true;
+            }
+            idle.wake_all();
+            return;
+          }
+          // the worker takes one released node itself and wakes idle
+          // workers for the others
+          std::size_t released_count = 0;
+          for (auto j: released[i]) {
+            if (--pending[j] == 0) {
+              idle.ready++;
+              std::lock_guard<std::mutex> guard(queues[w].lock);
+              queues[w].nodes.push_back(j);
+              released_count++;
+            }
+          }
+          if (released_count > 1) {
+            idle.wake(released_count - 1);
+          }
+          if (--remaining == 0) {
+            idle.wake_all();
+          }
+        }
+      });
+
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+
+  private:
+    // workers with no node to take sleep until one is ready or the run
+    // ends, ready counts nodes released but not yet taken
+    struct Idle {
+      Idle() : ready(0), sleepers(0) {}
+
+      // sleep until done() holds, done is checked after registering as a
+      // sleeper so a node released meanwhile is not missed
+      template <typename F>
+      void wait(const F& done) {
+        std::unique_lock<std::mutex> lock(mutex);
+        sleepers++;
+        cond.wait(lock, done);
+        sleepers--;
+      }
+
+      // wake up to n sleepers
+      void wake(std::size_t n) {
+        if (sleepers > 0) {
+          std::lock_guard<std::mutex> lock(mutex);
+          for (std::size_t k=0; k<n; k++) {
+            cond.notify_one();
+          }
+        }
+      }
+
+      // wake all sleepers
+      void wake_all() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cond.notify_all();
+      }
+
+      std::atomic<std::size_t> ready;
+      std::atomic<std::size_t> sleepers;
+      std::mutex mutex;
+      std::condition_variable cond;
+    };
+
+    // ready nodes of one worker, the owner takes the newest node and
+    // thieves the oldest
+    struct Queue {
+      std::mutex lock;
+      std::deque<int> nodes;
+    };
+
+    // take a node from the own queue or steal one, false if none is ready
+    static bool take(std::vector<Queue>& queues, std::size_t w, int& i) {
+      {
+        std::lock_guard<std::mutex> guard(queues[w].lock);
+        if (!queues[w].nodes.empty()) {
+          i = queues[w].nodes.back();
+          queues[w].nodes.pop_back();
+          return true;
+        }
+      }
+      for (std::size_t k=1; k<queues.size(); k++) {
+        auto& q = queues[(w + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (!q.nodes.empty()) {
+          i = q.nodes.front();
+          q.nodes.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    ThreadPool _pool;
+};
+
+#endif /*_DL_THREADS_H_*/
@@ -0,0 +1,141 @@
+#include "cpu.hh"
+#include "parallel.hh"
+#ifdef DL_BLAS
+#include "blas.hh"
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+
+// Dense backend benchmark, compares every CPU context built in
+namespace dl {
+  typedef float                           base_t;
+  typedef std::vector<base_t>             vector;
+  typedef Context<base_t,CPUMatrix>       context;
+  typedef CPUMatrix<base_t>               native;
+}
+
+// mean seconds per call of f
+template <typename F>
+double measure(F f, int repeat) {
+  // warm up caches and lazy backend init
+  f();
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i=0; i<repeat; i++) {
+    f();
+  }
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  return elapsed.count() / repeat;
+}
+
+// one result line, ops is the arithmetic or copy count per call
+void report(const char* backend, const char* op, int size,
+double seconds, double ops) {
+  std::printf("%-6s %-10s %6d %12.2f us %8.2f Gop/s\n",
+    backend, op, size, seconds * 1e6, ops / seconds * 1e-9);
+}
+
+void benchmark(const char* backend, dl::context& ctx, int size) {
+  std::size_t n = size * size;
+  std::unique_ptr<dl::native> a(ctx.create(size, size, n));
+  std::unique_ptr<dl::native> b(ctx.create(size, size, n));
+  std::unique_ptr<dl::native> r(ctx.create(size, size, n));
+
+  dl::vector v(n);
+  std::mt19937 gen(size);
+  std::uniform_real_distribution<dl::base_t> dist(-1, 1);
+  std::generate(v.begin(), v.end(), [&]() { return dist(gen); });
+  ctx.set(*a, v);
+  std::shuffle(v.begin(), v.end(), gen);
+  ctx.set(*b, v);
+  ctx.set(*r, 0);
+
+  // keep each measurement at a similar amount of work
+  int dense = std::max<std::size_t>(1, (1 << 28) / (n * size));
+  int element = std::max<std::size_t>(1, (1 << 24) / n);
+
+  report(backend, "prod", size, measure([&]() {
+    ctx.prod(*a, *b, *r);
+  }, dense), 2.0 * n * size);
+
+  report(backend, "gemm(T,T)", size, measure([&]() {
+    ctx.gemm(true, true, 1, *a, *b, 1, *r);
+  }, dense), 2.0 * n * size + 2.0 * n);
+
+  // matrix-vector product of a recurrent step
+  std::unique_ptr<dl::native> x(ctx.create(size, 1, size));
+  std::unique_ptr<dl::native> y(ctx.create(size, 1, size));
+  ctx.set(*x, 1);
+  report(backend, "gemv", size, measure([&]() {
+    ctx.prod(*a, *x, *y);
+  }, element), 2.0 * n);
+
+  report(backend, "mul", size, measure([&]() {
+    ctx.mul(*a, 0.5, *r);
+  }, element), n);
+
+  report(backend, "element", size, measure([&]() {
+    ctx.mul(*a, *b, *r);
+  }, element), n);
+
+  report(backend, "add", size, measure([&]() {
+    ctx.add(*a, *b, *r);
+  }, element), n);
+
+  report(backend, "exponent", size, measure([&]() {
+    ctx.exponent(*a, *r);
+  }, element), n);
+
+  dl::base_t sum = 0;
+  report(backend, "summation", size, measure([&]() {
+    sum += ctx.summation(*a);
+  }, element), n);
+
+  report(backend, "transpose", size, measure([&]() {
+    ctx.transpose(*a, *r);
+  }, element), n);
+}
+
+void context_error(const char* msg) {
+  throw std::runtime_error(msg);
+}
+
+int main(int argn, char** args) {
+  std::vector<int> sizes;
+  for (int i=1; i<argn; i++) {
+    sizes.push_back(std::atoi(args[i]));
+  }
+  if (sizes.empty()) {
+    sizes = {16, 64, 256, 1024};
+  }
+
+  try {
+    CPUContext<dl::base_t> cpu;
+    cpu.set_error_handler(context_error);
+    ParallelCPUContext<dl::base_t> par;
+    par.set_error_handler(context_error);
+#ifdef DL_BLAS
+    BLASContext<dl::base_t> blas;
+    blas.set_error_handler(context_error);
+#endif
+
+    for (auto size: sizes) {
+      benchmark("cpu", cpu, size);
+      benchmark("par", par, size);
+#ifdef DL_BLAS
+      benchmark("blas", blas, size);
+#endif
+    }
+  }
+  catch (std::exception& e) {
+    std::printf("Benchmark exception:\n%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
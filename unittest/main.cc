@@ -1,10 +1,18 @@
 #include "cpu.hh"
+#ifdef DL_BLAS
+#include "blas.hh"
+#endif
 #include "function.hh"
+#include "half.hh"
+#include "parallel.hh"
+#include "quant.hh"
+#include "sparse.hh"
 #include "network.hh"
 #include "unittest.hh"
 #include "utils.hh"
 
 #include <fstream>
+#include <thread>
 #include <unistd.h>
 
 #include <rapidjson/document.h>
@@ -27,12 +35,17 @@ namespace dl {
   typedef Summation<base_t,CPUMatrix>     summation;
   typedef Transpose<base_t,CPUMatrix>     transpose;
   typedef Exponent<base_t,CPUMatrix>      exponent;
+  typedef Reduction<base_t,CPUMatrix>     reduction;
+  typedef Runtime<base_t,CPUMatrix>       runtime;
+  typedef Timeline<base_t,CPUMatrix>      timeline;
   typedef Network<base_t,CPUMatrix>       network;
   typedef Resolver                        resolver;
 }
 
 const dl::base_t EPS = (sizeof(dl::base_t) < 8) ? 1e-3:1e-8;
 
+void context_error(const char* msg);
+
 void print(const dl::vector& vec, int rows, int cols) {
   std::cout << "[" << rows << " x " << cols << "]" << std::endl;
   for (int r=0; r<rows; r++) {
@@ -133,9 +146,240 @@ void test_matrix_context(dl::context& ctx) {
   ctx.put_matrix(m2);
   ctx.put_matrix(m3);
 
+  // shapes of the same size class share the cached buffers
   ASSERT(ctx.get_matrix_count() == 3);
-  ASSERT(ctx.get_matrix_count(2,3) == 2);
-  ASSERT(ctx.get_matrix_count(3,2) == 1);
+  ASSERT(ctx.get_matrix_count(2,3) == 3);
+  ASSERT(ctx.get_matrix_count(3,2) == 3);
+  ASSERT(ctx.get_matrix_count(1,6) == 3);
+  TEST_END()
+}
+
+void test_matrix_pool(dl::context& ctx) {
+  TEST_BEGIN("matrix Pool")
+
+  // a cached buffer is reshaped for another shape of its size class
+  auto m1 = ctx.get_matrix(4, 5);
+  ctx.put_matrix(m1);
+  auto m2 = ctx.get_matrix(5, 4);
+
+  ASSERT(m1 == m2)
+  ASSERT(ctx.rows(*m2) == 5 && ctx.cols(*m2) == 4)
+  ctx.put_matrix(m2);
+
+  // shape churn stays within the pool limit
+  ctx.trim();
+  ctx.set_pool_limit(64 * 64 * sizeof(dl::base_t));
+  for (int n=1; n<64; n++) {
+    dl::matrix A(ctx, n, 64);
+    dl::matrix B(ctx, 64, n);
+    ASSERT(ctx.get_cached_bytes() <= 64 * 64 * sizeof(dl::base_t))
+  }
+  ASSERT(ctx.get_cached_bytes() <= 64 * 64 * sizeof(dl::base_t))
+
+  // trim releases everything
+  ctx.set_pool_limit(SIZE_MAX);
+  ctx.trim();
+
+  ASSERT(ctx.get_matrix_count() == 0)
+  ASSERT(ctx.get_cached_bytes() == 0)
+  TEST_END()
+}
+
+void test_matrix_arena(dl::context& ctx) {
+  TEST_BEGIN("matrix Arena")
+
+  // function: f (a, b) = S(a * b)
+  auto ma = new dl::matrix(ctx, 2, 3);
+  auto mb = new dl::matrix(ctx, 3, 2);
+  ma->set({1,2,3,4,5,6});
+  mb->set({7,7,8,8,9,9});
+  std::unique_ptr<dl::variable> fa(new dl::variable(ma));
+  std::unique_ptr<dl::variable> fb(new dl::variable(mb));
+  std::unique_ptr<dl::product> ab(new dl::product(fa.get(), fb.get()));
+  std::unique_ptr<dl::summation> f(new dl::summation(ab.get()));
+
+  // the first step sizes the arena, the next steps use it
+  for (int step=0; step<3; step++) {
+    ctx.begin_step();
+    {
+      f->refresh(true);
+      dl::matrix d(ctx, 1, 1);
+      d.set(1);
+      f->forward();
+      f->backward(d);
+
+      auto m = ctx.get_matrix(2, 2);
+      ASSERT(ctx.is_transient(*m) == (step > 0))
+      ctx.put_matrix(m);
+    }
+    ctx.end_step();
+  }
+
+  // user matrices outlive a step, a view still in use keeps the arena
+  // closed for the next step until it is put back
+  ctx.begin_step();
+  auto user = new dl::matrix(ctx, 2, 2);
+  auto kept = ctx.get_matrix(2, 2);
+  ASSERT(ctx.is_transient(*kept))
+  ctx.end_step();
+  for (int step=0; step<2; step++) {
+    ctx.begin_step();
+    auto m = ctx.get_matrix(2, 2);
+    ASSERT(ctx.is_transient(*m) == (step > 0))
+    ctx.put_matrix(m);
+    if (step == 0) ctx.put_matrix(kept);
+    ctx.end_step();
+  }
+  delete user;
+
+  // persistent values and derivatives survive the step
+  dl::matrix mf(ctx, 1, 1);
+  mf.set(2 * (1*7+2*8+3*9) + 2 * (4*7+5*8+6*9));
+  dl::matrix da(ctx, 2, 3);
+  da.set({14,16,18,14,16,18});
+
+  ASSERT(f->forward() == mf)
+  ASSERT(fa->derivative() == da * 3.0)
+  TEST_END()
+}
+
+void test_matrix_stats(dl::context& ctx) {
+  TEST_BEGIN("matrix Stats")
+
+  ctx.trim();
+  ctx.reset_stats();
+  ctx.set_histogram(true);
+
+  // one miss, then a hit on the released buffer
+  {
+    dl::matrix A(ctx, 7, 9);
+  }
+  {
+    dl::matrix B(ctx, 9, 7);
+    auto stats = ctx.get_stats();
+    ASSERT(stats.misses == 1)
+    ASSERT(stats.hits == 1)
+    ASSERT(stats.live_bytes == 64 * sizeof(dl::base_t))
+    ASSERT(stats.cached_bytes == 0)
+    ASSERT((stats.shapes[{7,9}] == 1))
+    ASSERT((stats.shapes[{9,7}] == 1))
+  }
+
+  auto stats = ctx.get_stats();
+  ASSERT(stats.live_bytes == 0)
+  ASSERT(stats.cached_bytes == 64 * sizeof(dl::base_t))
+  ASSERT(stats.peak_bytes >= stats.cached_bytes + stats.arena_bytes)
+
+  // JSON dump
+  std::ostringstream json;
+  ctx.print_stats(json);
+  ASSERT(json.str().find("\"misses\":1,") != std::string::npos)
+  ASSERT(json.str().find("[7,9,1]") != std::string::npos)
+
+  ctx.set_histogram(false);
+  TEST_END()
+}
+
+void test_matrix_pages(dl::context& ctx) {
+  TEST_BEGIN("matrix Pages")
+
+  // buffers are 64 byte aligned by default
+  dl::context aligned;
+  auto m1 = aligned.get_matrix(3, 5);
+  ASSERT(reinterpret_cast<std::uintptr_t>(m1->data()) % 64 == 0)
+  aligned.put_matrix(m1);
+
+  // larger alignment on request
+  aligned.set_alignment(4096);
+  auto m2 = aligned.get_matrix(7, 5);
+  ASSERT(reinterpret_cast<std::uintptr_t>(m2->data()) % 4096 == 0)
+  aligned.put_matrix(m2);
+
+  // huge page backed buffers fall back to regular pages if unavailable
+  for (auto pages: {PAGES_TRANSPARENT, PAGES_HUGETLB}) {
+    dl::context huge;
+    huge.set_pages(pages, 1024 * 1024);
+    dl::matrix A(huge, 1024, 512);
+    dl::matrix B(huge, 2, 3);
+    A.set(1);
+    B.set(2);
+    ASSERT(A.S() == 1024 * 512)
+    ASSERT(B.S() == 12)
+  }
+  TEST_END()
+}
+
+void test_matrix_threads(dl::context& ctx) {
+  TEST_BEGIN("matrix Threads")
+
+  // concurrent allocation and release from many threads
+  std::vector<std::thread> workers;
+  std::vector<int> failures(4, 0);
+  for (int t=0; t<4; t++) {
+    workers.emplace_back([&ctx, &failures, t]() {
+      for (int i=0; i<1000; i++) {
+        dl::matrix A(ctx, 2, 3);
+        dl::matrix B(ctx, 2, 3);
+        A.set(t);
+        B.set(i);
+        dl::vector c = A + B;
+        if (c != dl::vector(6, t + i)) failures[t]++;
+      }
+    });
+  }
+  for (auto& w: workers) w.join();
+
+  ASSERT(failures == std::vector<int>(4, 0))
+
+  // matrices over shard limit go to the shared overflow
+  ctx.set_shard_limit(1);
+  auto m1 = ctx.get_matrix(4, 5);
+  auto m2 = ctx.get_matrix(4, 5);
+  auto m3 = ctx.get_matrix(4, 5);
+  ctx.put_matrix(m1);
+  ctx.put_matrix(m2);
+  ctx.put_matrix(m3);
+  ctx.set_shard_limit(64);
+
+  ASSERT(ctx.get_matrix_count(4,5) == 3)
+
+  // shards of exited threads are freed, their matrices stay cached
+  {
+    dl::context local;
+    std::thread([&local]() { dl::matrix A(local, 2, 3); }).join();
+    ASSERT(local.get_matrix_count(2,3) == 1)
+    ASSERT(local.get_stats().shards == 1)
+  }
+
+  // a context destroyed before a thread that used it exits
+  {
+    auto gone = new dl::context();
+    std::mutex lock;
+    std::condition_variable cond;
+    int state = 0;
+    std::thread worker([&]() {
+      { dl::matrix A(*gone, 2, 3); }
+      std::unique_lock<std::mutex> guard(lock);
+      state = 1;
+      cond.notify_all();
+      cond.wait(guard, [&]() { return state == 2; });
+    });
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      cond.wait(guard, [&]() { return state == 1; });
+    }
+    delete gone;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      state = 2;
+      cond.notify_all();
+    }
+    worker.join();
+
+    dl::context fresh;
+    std::thread([&fresh]() { dl::matrix A(fresh, 2, 3); }).join();
+    ASSERT(fresh.get_matrix_count(2,3) == 1)
+  }
   TEST_END()
 }
 
@@ -249,6 +493,36 @@ void test_matrix_product(dl::context& ctx) {
   TEST_END()
 }
 
+#ifdef DL_BLAS
+void test_matrix_blas(dl::context& ctx) {
+  TEST_BEGIN("matrix BLAS")
+
+  BLASContext<dl::base_t> blas;
+  blas.set_error_handler(context_error);
+
+  dl::matrix A(ctx, 2, 3), a(blas, 2, 3);
+  dl::matrix B(ctx, 2, 3), b(blas, 2, 3);
+  A = dl::vector({1,2,3,4,5,6}); a = dl::vector(A);
+  B = dl::vector({2,3,4,5,6,7}); b = dl::vector(B);
+
+  // results must match the Eigen context
+  ASSERT(dl::vector(A * B.T()) == dl::vector(a * b.T()))
+  ASSERT(dl::vector(A.T() * B) == dl::vector(a.T() * b))
+  ASSERT(dl::vector(A * 3) == dl::vector(a * 3))
+  ASSERT(dl::vector(A + B) == dl::vector(a + b))
+  ASSERT(dl::vector(A & B) == dl::vector(a & b))
+  ASSERT(dl::vector(A.T()) == dl::vector(a.T()))
+
+  dl::matrix C(ctx, 2, 2), c(blas, 2, 2);
+  C = 1; c = 1;
+  C.gemm(false, true, 2, A, B, 0.5);
+  c.gemm(false, true, 2, a, b, 0.5);
+
+  ASSERT(dl::vector(C) == dl::vector(c))
+  TEST_END()
+}
+#endif
+
 void test_matrix_element(dl::context& ctx) {
   TEST_BEGIN("matrix Element")
 
@@ -272,6 +546,61 @@ void test_matrix_element(dl::context& ctx) {
   TEST_END()
 }
 
+void test_matrix_compound(dl::context& ctx) {
+  TEST_BEGIN("matrix Compound")
+
+  dl::matrix A(ctx, 2, 3);
+  dl::matrix B(ctx, 2, 3);
+  dl::matrix C(ctx, 2, 3);
+  A.set({1,2,3,4,5,6});
+  B.set({6,5,4,3,2,1});
+
+  A += B;
+  C.set({7,7,7,7,7,7});
+  ASSERT(A == C)
+
+  A -= B;
+  C.set({1,2,3,4,5,6});
+  ASSERT(A == C)
+
+  A *= 2;
+  C.set({2,4,6,8,10,12});
+  ASSERT(A == C)
+
+  A.axpy(-2, B);
+  C.set({-10,-6,-2,2,6,10});
+  ASSERT(A == C)
+  TEST_END()
+}
+
+void test_matrix_expression(dl::context& ctx) {
+  TEST_BEGIN("matrix Expression")
+
+  dl::matrix A(ctx, 2, 3);
+  dl::matrix B(ctx, 2, 3);
+  dl::matrix C(ctx, 2, 3);
+  dl::matrix D(ctx, 2, 3);
+  dl::matrix R(ctx, 2, 3);
+  A.set({1,2,3,4,5,6});
+  B.set({6,5,4,3,2,1});
+  C.set({1,1,1,2,2,2});
+
+  // element-wise chain evaluated into an existing matrix in one pass
+  auto stats = ctx.get_stats();
+  D = A + B - C * 2 + (A - B) * 0.5;
+  ASSERT(ctx.get_stats().hits == stats.hits)
+  ASSERT(ctx.get_stats().misses == stats.misses)
+
+  R.set({2.5,3.5,4.5,3.5,4.5,5.5});
+  ASSERT(D == R)
+
+  // operands may alias the result
+  A = B + A - A * 2;
+  R.set({5,3,1,-1,-3,-5});
+  ASSERT(A == R)
+  TEST_END()
+}
+
 void test_matrix_transpose(dl::context& ctx) {
   TEST_BEGIN("matrix Transpose")
 
@@ -284,6 +613,521 @@ void test_matrix_transpose(dl::context& ctx) {
   TEST_END()
 }
 
+void test_matrix_simd(dl::context& ctx) {
+  TEST_BEGIN("matrix SIMD")
+
+  // reference results from Eigen, 7x9 leaves a tail at every vector width
+  dl::context eigen;
+  eigen.set_simd(SIMD_NONE);
+  ASSERT(eigen.get_simd() == SIMD_NONE)
+
+  dl::vector va(63), vb(63);
+  for (int i=0; i<63; i++) {
+    va[i] = (i - 31) * 0.37;
+    vb[i] = (i % 5) - 2.5;
+  }
+  dl::matrix A(eigen, 7, 9), B(eigen, 7, 9);
+  A = va;
+  B = vb;
+  dl::matrix sum = A + B, dif = A - B, mul = A & B;
+  dl::vector exp = A.E();
+
+  for (auto level: {SIMD_SSE4, SIMD_AVX2, SIMD_AVX512}) {
+    dl::context simd;
+    simd.set_simd(level);
+    ASSERT(simd.get_simd() <= level)
+
+    dl::matrix a(simd, 7, 9), b(simd, 7, 9);
+    a = va;
+    b = vb;
+
+    ASSERT(dl::vector(a + b) == dl::vector(sum))
+    ASSERT(dl::vector(a - b) == dl::vector(dif))
+    ASSERT(dl::vector(a & b) == dl::vector(mul))
+    ASSERT(std::abs(a.S() - A.S()) < EPS)
+
+    // exp within a few ulp of Eigen
+    dl::vector e = a.E();
+    for (int i=0; i<63; i++) {
+      ASSERT(std::abs(e[i] - exp[i]) <= 4e-7 * exp[i])
+    }
+
+    // in place add and subtract
+    a += b;
+    a -= b;
+    ASSERT(a == A)
+  }
+  TEST_END()
+}
+
+void test_matrix_parallel(dl::context& ctx) {
+  TEST_BEGIN("matrix Parallel")
+
+  // split every op, odd shapes leave uneven blocks and ranges
+  ParallelCPUContext<dl::base_t> par(4);
+  par.set_threshold(1);
+  ASSERT(par.get_threads() == 4)
+
+  dl::vector va(37 * 53), vb(53 * 29);
+  for (int i=0; i<va.size(); i++) {
+    va[i] = ((i * 7) % 19) * 0.1 - 0.9;
+  }
+  for (int i=0; i<vb.size(); i++) {
+    vb[i] = ((i * 5) % 23) * 0.1 - 1.1;
+  }
+
+  dl::matrix A(ctx, 37, 53), B(ctx, 53, 29), C(ctx, 37, 53);
+  dl::matrix a(par, 37, 53), b(par, 53, 29), c(par, 37, 53);
+  A = va; a = va;
+  B = vb; b = vb;
+  C = dl::vector(A.E()); c = dl::vector(C);
+
+  ASSERT(a * b == A * B)
+  ASSERT(dl::matrix(a + c) == dl::matrix(A + C))
+  ASSERT(dl::matrix(a - c) == dl::matrix(A - C))
+  ASSERT((a & c) == (A & C))
+  ASSERT(a.E() == A.E())
+  ASSERT(std::abs(a.S() - A.S()) < EPS)
+
+  // transposed products accumulate into row blocks
+  dl::matrix G(ctx, 53, 53), g(par, 53, 53);
+  G = 1; g = 1;
+  G.gemm(true, false, 0.5, A, C, 2);
+  g.gemm(true, false, 0.5, a, c, 2);
+  ASSERT(g == G)
+  G.gemm(false, true, 1, C, A, 0);
+  g.gemm(false, true, 1, c, a, 0);
+  ASSERT(g == G)
+  G.gemm(true, true, 1, B, A, 0);
+  g.gemm(true, true, 1, b, a, 0);
+  ASSERT(g == G)
+
+  // in place ops
+  c += a;
+  c *= 3;
+  c.axpy(-2, a);
+  C += A;
+  C *= 3;
+  C.axpy(-2, A);
+  ASSERT(c == C)
+
+  // a nested run on the calling thread runs serially
+  ThreadPool pool(4);
+  std::atomic<int> count(0);
+  pool.run(4, [&](std::size_t i) {
+    pool.run(8, [&](std::size_t j) {
+      count++;
+    });
+  });
+  ASSERT(count == 32)
+  TEST_END()
+}
+
+void test_matrix_half(dl::context& ctx) {
+  TEST_BEGIN("matrix Half")
+
+  typedef Matrix<dl::base_t,HalfMatrix> hmatrix;
+  typedef Variable<dl::base_t,HalfMatrix> hvariable;
+  typedef Product<dl::base_t,HalfMatrix> hproduct;
+  typedef Exponent<dl::base_t,HalfMatrix> hexponent;
+
+  // within the relative precision of the storage format
+  auto close = [](const dl::vector& a, const dl::vector& b, dl::base_t tol) {
+    for (int i=0; i<a.size(); i++) {
+      dl::base_t scale = std::max<dl::base_t>(1, std::abs(b[i]));
+      if (std::abs(a[i] - b[i]) > tol * scale) {
+        return false;
+      }
+    }
+    return a.size() == b.size();
+  };
+
+  dl::vector va({1, 2.5, -3, 0.125, 5, -6}), vb({0.5, 7, 8, -1.5, 9, 2});
+
+  for (auto format: {HALF_BF16, HALF_FP16}) {
+    HalfContext<dl::base_t> half(format);
+    half.set_error_handler(context_error);
+    dl::base_t tol = (format == HALF_BF16) ? 1.0 / 128 : 1.0 / 1024;
+
+    hmatrix A(half, 2, 3), B(half, 3, 2), C(half, 2, 3);
+    dl::matrix a(ctx, 2, 3), b(ctx, 3, 2), c(ctx, 2, 3);
+    A = va; a = va;
+    B = vb; b = vb;
+    C = vb; c = vb;
+
+    // exact values survive the 16 bit storage
+    ASSERT(dl::vector(A) == va)
+
+    ASSERT(close(A * B, a * b, tol))
+    ASSERT(close(hmatrix(A + C), dl::matrix(a + c), tol))
+    ASSERT(close(hmatrix(A - C), dl::matrix(a - c), tol))
+    ASSERT(close(A & C, a & c, tol))
+    ASSERT(close(hmatrix(A * 0.5), dl::matrix(a * 0.5), tol))
+    ASSERT(close(A.T(), a.T(), tol))
+    ASSERT(close(hmatrix(A * 0.1).E(), dl::matrix(a * 0.1).E(), tol))
+    ASSERT(std::abs(A.S() - a.S()) < tol)
+
+    // functions run unchanged over 16 bit storage
+    hvariable fa(new hmatrix(A)), fb(new hmatrix(B));
+    hproduct fab(&fa, &fb);
+    hexponent f(&fab);
+    dl::variable ga(new dl::matrix(a)), gb(new dl::matrix(b));
+    dl::product gab(&ga, &gb);
+    dl::exponent g(&gab);
+
+    fa.value() *= 0.1;
+    ga.value() *= 0.1;
+    ASSERT(close(f.forward(), g.forward(), 2 * tol))
+
+    hmatrix hd(half, 2, 2);
+    dl::matrix gd(ctx, 2, 2);
+    hd = 1;
+    gd = 1;
+    f.backward(hd);
+    g.backward(gd);
+    ASSERT(close(fa.derivative(), ga.derivative(), 4 * tol))
+    ASSERT(close(fb.derivative(), gb.derivative(), 4 * tol))
+
+    // half the bytes of float storage
+    HalfContext<dl::base_t> empty(format);
+    dl::context full;
+    hmatrix H(empty, 32, 32);
+    dl::matrix F(full, 32, 32);
+    ASSERT(2 * empty.get_stats().live_bytes == full.get_stats().live_bytes)
+  }
+  TEST_END()
+}
+
+void test_matrix_quant(dl::context& ctx) {
+  TEST_BEGIN("matrix Quant")
+
+  typedef Matrix<dl::base_t,QuantMatrix> qmatrix;
+  typedef Variable<dl::base_t,QuantMatrix> qvariable;
+  typedef Product<dl::base_t,QuantMatrix> qproduct;
+  typedef Exponent<dl::base_t,QuantMatrix> qexponent;
+
+  // within tol of the largest magnitude of the expected values
+  auto close = [](const dl::vector& a, const dl::vector& b, dl::base_t tol) {
+    dl::base_t scale = 0;
+    for (auto x: b) {
+      scale = std::max<dl::base_t>(scale, std::abs(x));
+    }
+    for (int i=0; i<a.size(); i++) {
+      if (std::abs(a[i] - b[i]) > tol * scale) {
+        return false;
+      }
+    }
+    return a.size() == b.size();
+  };
+
+  dl::vector va({1, 2.5, -3, 0.125, 5, -6}), vb({0.5, 7, 8, -1.5, 9, 2});
+  dl::base_t tol = 2.0 / 127;
+
+  for (auto mode: {QUANT_TENSOR, QUANT_ROW}) {
+    QuantContext<dl::base_t> quant(mode);
+    quant.set_error_handler(context_error);
+
+    qmatrix A(quant, 2, 3), B(quant, 3, 2), C(quant, 2, 3);
+    dl::matrix a(ctx, 2, 3), b(ctx, 3, 2), c(ctx, 2, 3);
+    A = va; a = va;
+    B = vb; b = vb;
+    C = vb; c = vb;
+
+    ASSERT(close(A, a, tol))
+    ASSERT(close(A * B, a * b, 2 * tol))
+    ASSERT(close(qmatrix(A + C), dl::matrix(a + c), tol))
+    ASSERT(close(qmatrix(A - C), dl::matrix(a - c), tol))
+    ASSERT(close(A & C, a & c, 2 * tol))
+    ASSERT(close(qmatrix(A * 0.5), dl::matrix(a * 0.5), tol))
+    ASSERT(close(A.T(), a.T(), tol))
+    ASSERT(close(B.T() * A.T(), b.T() * a.T(), 2 * tol))
+    ASSERT(std::abs(A.S() - a.S()) < 6 * 3.0 / 127)
+
+    qmatrix G(quant, 2, 2);
+    dl::matrix g(ctx, 2, 2);
+    G = 1;
+    g = 1;
+    G.gemm(true, true, 0.5, B, A, 2);
+    g.gemm(true, true, 0.5, b, a, 2);
+    ASSERT(close(G, g, 2 * tol))
+
+    // the same graph runs forward over int8 storage
+    qvariable fa(new qmatrix(A)), fb(new qmatrix(B));
+    qproduct fab(&fa, &fb);
+    qexponent f(&fab);
+    dl::variable ga(new dl::matrix(a)), gb(new dl::matrix(b));
+    dl::product gab(&ga, &gb);
+    dl::exponent h(&gab);
+
+    fa.value() *= 0.05;
+    ga.value() *= 0.05;
+    ASSERT(close(f.forward(), h.forward(), 4 * tol))
+
+    // calibrated ranges saturate larger values
+    qvariable x(new qmatrix(quant, 1, 2));
+    qexponent ex(&x);
+    quant.begin_calibration();
+    x.value() = dl::vector({0, 1});
+    ex.forward();
+    quant.end_calibration();
+    x.value() = dl::vector({2, -1});
+    ex.refresh(true);
+    dl::vector y = ex.forward();
+    ASSERT(std::abs(y[0] - std::exp(1.0)) < tol * 3)
+    ASSERT(std::abs(y[1] - std::exp(-1.0)) < tol * 3)
+
+    // a quarter of the bytes of float storage
+    QuantContext<dl::base_t> empty(mode);
+    dl::context full;
+    qmatrix Q(empty, 32, 32);
+    dl::matrix F(full, 32, 32);
+    ASSERT(4 * empty.get_stats().live_bytes == full.get_stats().live_bytes)
+  }
+  TEST_END()
+}
+
+void test_matrix_sparse(dl::context& ctx) {
+  TEST_BEGIN("matrix Sparse")
+
+  typedef Matrix<dl::base_t,SparseCPUMatrix> smatrix;
+  typedef Variable<dl::base_t,SparseCPUMatrix> svariable;
+  typedef Constant<dl::base_t,SparseCPUMatrix> sconstant;
+  typedef Product<dl::base_t,SparseCPUMatrix> sproduct;
+  typedef Element<dl::base_t,SparseCPUMatrix> selement;
+
+  auto close = [](const dl::vector& a, const dl::vector& b) {
+    for (int i=0; i<a.size(); i++) {
+      if (std::abs(a[i] - b[i]) > EPS) {
+        return false;
+      }
+    }
+    return a.size() == b.size();
+  };
+
+  SparseCPUContext<dl::base_t> sparse;
+  sparse.set_error_handler(context_error);
+
+  dl::vector vx({0, 2, 0, 0, 1, 0, 0, 0, 0, 0, -3, 0});
+  dl::vector vw({1, 2, 3, 4, 5, 6});
+  dl::vector vd({7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18});
+
+  smatrix X(sparse, 3, 4), W(sparse, 2, 3), D(sparse, 3, 4);
+  dl::matrix x(ctx, 3, 4), w(ctx, 2, 3), d(ctx, 3, 4);
+  X = vx; x = vx;
+  W = vw; w = vw;
+  D = vd; d = vd;
+  sparse.sparsify(X.native());
+
+  ASSERT(X.native().sparse())
+  ASSERT(X.native().csr().nonZeros() == 3)
+  ASSERT(dl::vector(X) == vx)
+
+  // triplets build the same values
+  smatrix Y(sparse, 3, 4);
+  sparse.set_sparse(Y.native(), {{0, 1, 2}, {1, 0, 1}, {2, 2, -3}});
+  ASSERT(dl::vector(Y) == vx)
+
+  // copies and sparse preserving ops stay sparse
+  smatrix C(X);
+  ASSERT(C.native().sparse())
+  ASSERT(dl::vector(C) == vx)
+  ASSERT(X.T().native().sparse())
+  ASSERT(close(X.T(), x.T()))
+  ASSERT((X & D).native().sparse())
+  ASSERT(close(X & D, x & d))
+  ASSERT(close(D & X, d & x))
+  ASSERT(close(smatrix(X * 0.5), dl::matrix(x * 0.5)))
+  ASSERT(std::abs(X.S() - x.S()) < EPS)
+
+  // sparse and dense operands mix
+  ASSERT(close(W * X, w * x))
+  ASSERT(close(X.T() * W.T(), x.T() * w.T()))
+  ASSERT(close(smatrix(X + D), dl::matrix(x + d)))
+  ASSERT(close(smatrix(D - X), dl::matrix(d - x)))
+  ASSERT(close(smatrix(X + X), dl::matrix(x + x)))
+  ASSERT(close(X.E(), x.E()))
+
+  smatrix G(sparse, 4, 4);
+  dl::matrix g(ctx, 4, 4);
+  G = 1;
+  g = 1;
+  G.gemm(true, false, 2, X, D, 0.5);
+  g.gemm(true, false, 2, x, d, 0.5);
+  ASSERT(close(G, g))
+  G.gemm(true, false, 1, D, X, 1);
+  g.gemm(true, false, 1, d, x, 1);
+  ASSERT(close(G, g))
+
+  // dense accumulation of sparse values
+  smatrix A(D);
+  dl::matrix a(d);
+  A += X;
+  a += x;
+  ASSERT(!A.native().sparse())
+  ASSERT(close(A, a))
+  A.axpy(-2, X);
+  a.axpy(-2, x);
+  ASSERT(close(A, a))
+
+  // sparse constants feed dense weights in a graph
+  sconstant fx(new smatrix(X));
+  svariable fw(new smatrix(W)), fd(new smatrix(sparse, 2, 4));
+  sproduct fwx(&fw, &fx);
+  selement f(&fwx, &fd);
+  dl::constant gx(new dl::matrix(x));
+  dl::variable gw(new dl::matrix(w)), gd(new dl::matrix(ctx, 2, 4));
+  dl::product gwx(&gw, &gx);
+  dl::element h(&gwx, &gd);
+
+  fd.value() = dl::vector({1, 2, 3, 4, 5, 6, 7, 8});
+  gd.value() = dl::vector({1, 2, 3, 4, 5, 6, 7, 8});
+  ASSERT(fx.value().native().sparse())
+  ASSERT(close(f.forward(), h.forward()))
+
+  smatrix sd(sparse, 2, 4);
+  dl::matrix hd(ctx, 2, 4);
+  sd = 1;
+  hd = 1;
+  f.backward(sd);
+  h.backward(hd);
+  ASSERT(close(fw.derivative(), gw.derivative()))
+  ASSERT(close(fd.derivative(), gd.derivative()))
+  TEST_END()
+}
+
+void test_matrix_fixed(dl::context& ctx) {
+  TEST_BEGIN("matrix Fixed")
+
+  dl::context dynamic;
+  dynamic.set_fixed(false);
+
+  auto close = [](const dl::vector& a, const dl::vector& b) {
+    for (int i=0; i<a.size(); i++) {
+      dl::base_t scale = std::max<dl::base_t>(1, std::abs(b[i]));
+      if (std::abs(a[i] - b[i]) > EPS * scale) {
+        return false;
+      }
+    }
+    return a.size() == b.size();
+  };
+
+  // fixed kernels match the dynamic path for all sides and one without
+  for (int m: {8, 16, 32, 64, 12}) {
+    for (int k: {8, 32, 64}) {
+      dl::vector va(m * k), vb(k), vc(m);
+      for (int i=0; i<va.size(); i++) va[i] = (i % 7) * 0.25 - 0.5;
+      for (int i=0; i<vb.size(); i++) vb[i] = (i % 5) * 0.5 - 1;
+      for (int i=0; i<vc.size(); i++) vc[i] = (i % 3) - 1;
+
+      for (dl::base_t beta: {0.0, 1.0, 0.5}) {
+        dl::matrix a(ctx, m, k), at(ctx, k, m), b(ctx, k, 1), c(ctx, m, 1);
+        dl::matrix da(dynamic, m, k), dat(dynamic, k, m), db(dynamic, k, 1);
+        dl::matrix dc(dynamic, m, 1);
+        a = va; da = va;
+        at = a.T(); dat = da.T();
+        b = vb; db = vb;
+
+        c = vc; dc = vc;
+        c.gemm(false, false, 2, a, b, beta);
+        dc.gemm(false, false, 2, da, db, beta);
+        ASSERT(close(c, dc))
+
+        c = vc; dc = vc;
+        c.gemm(true, false, 2, at, b, beta);
+        dc.gemm(true, false, 2, dat, db, beta);
+        ASSERT(close(c, dc))
+
+        dl::matrix o(ctx, m, k), dout(dynamic, m, k);
+        o = va; dout = va;
+        o.gemm(false, true, 2, c, b, beta);
+        dout.gemm(false, true, 2, dc, db, beta);
+        ASSERT(close(o, dout))
+      }
+    }
+  }
+  TEST_END()
+}
+
+void test_matrix_batch(dl::context& ctx) {
+  TEST_BEGIN("matrix Batch")
+
+  // 3 samples of 2x1 vectors and of 2x2 matrices
+  dl::matrix w(ctx, 2, 2), x(ctx, 2, 1, 3, false), m(ctx, 2, 2, 3, false);
+  w = dl::vector({1, 2, 3, 4});
+  x = dl::vector({1, 2, 3, 4, 5, 6});
+  m = dl::vector({1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 1, 0});
+  ASSERT(x.rows() == 2 && x.cols() == 1 && x.batch() == 3)
+
+  // a shared operand multiplies every sample
+  dl::matrix y = w * x;
+  ASSERT(y.batch() == 3)
+  ASSERT(dl::vector(y) == dl::vector({5, 11, 11, 25, 17, 39}))
+  ASSERT(dl::vector(x.T() * w) == dl::vector({7, 10, 15, 22, 23, 34}))
+  ASSERT(dl::vector(m * x) == dl::vector({5, 2, 6, 11, 6, 5}))
+  ASSERT(dl::vector(m.T()) ==
+    dl::vector({1, 0, 2, 1, 2, 1, 0, 2, 0, 1, 1, 0}))
+
+  // element-wise ops run over all samples
+  ASSERT(dl::vector(dl::matrix(x + x)) ==
+    dl::vector({2, 4, 6, 8, 10, 12}))
+  ASSERT(dl::vector(x & x) == dl::vector({1, 4, 9, 16, 25, 36}))
+  ASSERT((x.E()).batch() == 3)
+
+  // a batch of scalars scales sample by sample
+  dl::matrix s(ctx, 1, 1, 3, false);
+  s = dl::vector({1, 2, 3});
+  ASSERT(dl::vector(s * w) ==
+    dl::vector({1, 2, 3, 4, 2, 4, 6, 8, 3, 6, 9, 12}))
+
+  // summation per sample and over the batch
+  dl::matrix r(ctx, 1, 1);
+  x.sums(r);
+  ASSERT(r.batch() == 3)
+  ASSERT(dl::vector(r) == dl::vector({3, 7, 11}))
+  ASSERT(x.S() == 21)
+
+  // an unbatched result sums over the batch
+  dl::matrix g(ctx, 2, 1);
+  g = 0;
+  g += x;
+  ASSERT(dl::vector(g) == dl::vector({9, 12}))
+  g.axpy(2, x);
+  ASSERT(dl::vector(g) == dl::vector({27, 36}))
+
+  dl::matrix dw(ctx, 2, 2);
+  dw.gemm(false, true, 1, y, x, 0);
+  ASSERT(dw.batch() == 1)
+  ASSERT(dl::vector(dw) == dl::vector({123, 156, 281, 356}))
+  dw.gemm(false, false, 1, m, m, 0);
+  ASSERT(dl::vector(dw) == dl::vector({6, 4, 4, 6}))
+
+  // samples of odd size start off the 64 byte boundaries of the buffer
+  dl::matrix a(ctx, 5, 5, 3, false), b(ctx, 5, 5, 3, false);
+  dl::vector va(75), vb(75), vab(75), vt(75), vs(3);
+  for (int i=0; i<75; i++) {
+    va[i] = (i % 7) - 3;
+    vb[i] = (i % 4) - 1;
+  }
+  a = va;
+  b = vb;
+  for (int k=0; k<3; k++) {
+    for (int i=0; i<5; i++) {
+      for (int j=0; j<5; j++) {
+        for (int l=0; l<5; l++) {
+          vab[k*25 + i*5 + j] += va[k*25 + i*5 + l] * vb[k*25 + l*5 + j];
+        }
+        vt[k*25 + j*5 + i] = va[k*25 + i*5 + j];
+        vs[k] += va[k*25 + i*5 + j];
+      }
+    }
+  }
+  ASSERT(dl::vector(a * b) == vab)
+  ASSERT(dl::vector(a.T()) == vt)
+  a.sums(r);
+  ASSERT(dl::vector(r) == vs)
+  TEST_END()
+}
+
 void test_matrix_exponent(dl::context& ctx) {
   TEST_BEGIN("matrix Exponent")
 
@@ -309,6 +1153,183 @@ void test_matrix_summation(dl::context& ctx) {
   TEST_END()
 }
 
+void test_matrix_reduce(dl::context& ctx) {
+  TEST_BEGIN("matrix Reduce")
+
+  dl::matrix A(ctx, 2, 3);
+  A = {1,2,3,4,5,9};
+
+  auto close = [](const dl::vector& a, const dl::vector& b) {
+    if (a.size() != b.size()) {
+      return false;
+    }
+    for (std::size_t i=0; i<a.size(); i++) {
+      if (std::abs(a[i] - b[i]) > EPS) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // one value per row
+  dl::matrix R = A.reduce(REDUCE_SUM, AXIS_ROWS);
+  ASSERT(R.rows() == 2 && R.cols() == 1)
+  ASSERT(close(R, {6, 18}))
+  ASSERT(close(A.reduce(REDUCE_MEAN, AXIS_ROWS), {2, 6}))
+  ASSERT(close(A.reduce(REDUCE_MAX, AXIS_ROWS), {3, 9}))
+  ASSERT(close(A.reduce(REDUCE_LOGSUMEXP, AXIS_ROWS),
+    {std::log(std::exp(1.f) + std::exp(2.f) + std::exp(3.f)),
+     std::log(std::exp(4.f) + std::exp(5.f) + std::exp(9.f))}))
+
+  // one value per column
+  dl::matrix C = A.reduce(REDUCE_SUM, AXIS_COLS);
+  ASSERT(C.rows() == 1 && C.cols() == 3)
+  ASSERT(close(C, {5, 7, 12}))
+  ASSERT(close(A.reduce(REDUCE_MEAN, AXIS_COLS), {2.5, 3.5, 6}))
+  ASSERT(close(A.reduce(REDUCE_MAX, AXIS_COLS), {4, 5, 9}))
+  ASSERT(close(A.reduce(REDUCE_LOGSUMEXP, AXIS_COLS),
+    {std::log(std::exp(1.f) + std::exp(4.f)),
+     std::log(std::exp(2.f) + std::exp(5.f)),
+     std::log(std::exp(3.f) + std::exp(9.f))}))
+
+  // per sample reductions of a batch
+  dl::matrix B(ctx, 2, 3, 2, false);
+  B = {1,2,3,4,5,9, -1,0,1,2,2,2};
+  dl::matrix BR = B.reduce(REDUCE_MAX, AXIS_ROWS);
+  ASSERT(BR.rows() == 2 && BR.cols() == 1 && BR.batch() == 2)
+  ASSERT(close(BR, {3, 9, 1, 2}))
+  dl::matrix BC = B.reduce(REDUCE_SUM, AXIS_COLS);
+  ASSERT(BC.rows() == 1 && BC.cols() == 3 && BC.batch() == 2)
+  ASSERT(close(BC, {5, 7, 12, 1, 2, 3}))
+
+  // pairwise sums keep float error small over many terms
+  std::size_t n = 1 << 22;
+  dl::matrix L(ctx, 1, n), LT(ctx, n, 1);
+  L = dl::base_t(0.1);
+  LT = dl::base_t(0.1);
+  dl::vector s = L.reduce(REDUCE_SUM, AXIS_ROWS);
+  dl::vector st = LT.reduce(REDUCE_SUM, AXIS_COLS);
+  ASSERT(std::abs(s[0] - 0.1 * n) < 1e-5 * n)
+  ASSERT(std::abs(st[0] - 0.1 * n) < 1e-5 * n)
+  ASSERT(std::abs(L.S() - 0.1 * n) < 1e-5 * n)
+
+  // logsumexp does not overflow
+  dl::matrix X(ctx, 1, 3);
+  X = {1000, 1000, -1000};
+  dl::vector lse = X.reduce(REDUCE_LOGSUMEXP, AXIS_ROWS);
+  ASSERT(std::abs(lse[0] - (1000 + std::log(2.f))) < EPS)
+
+  // parallel reductions equal serial ones
+  ParallelCPUContext<dl::base_t> par(4);
+  par.set_threshold(1);
+  dl::vector va(37 * 53);
+  for (int i=0; i<va.size(); i++) {
+    va[i] = ((i * 7) % 19) * 0.1 - 0.9;
+  }
+  dl::matrix P(ctx, 37, 53), p(par, 37, 53);
+  P = va; p = va;
+  for (auto op: {REDUCE_SUM, REDUCE_MEAN, REDUCE_MAX, REDUCE_LOGSUMEXP}) {
+    ASSERT(p.reduce(op, AXIS_ROWS) == P.reduce(op, AXIS_ROWS))
+    ASSERT(p.reduce(op, AXIS_COLS) == P.reduce(op, AXIS_COLS))
+  }
+
+  // mismatched result shapes are rejected
+  CPUMatrix<dl::base_t> r(3, 1, 3, CPUAllocator());
+  bool error = false;
+  try {
+    ctx.reduce(REDUCE_SUM, AXIS_ROWS, A.native(), r);
+  }
+  catch (const std::runtime_error&) {
+    error = true;
+  }
+  ASSERT(error)
+  TEST_END()
+}
+
+void test_matrix_broadcast(dl::context& ctx) {
+  TEST_BEGIN("matrix Broadcast")
+
+  dl::matrix A(ctx, 2, 3), S(ctx, 1, 1), R(ctx, 1, 3), C(ctx, 2, 1);
+  A = {1,2,3,4,5,6};
+  S = {2};
+  R = {1,0,-1};
+  C = {10,20};
+
+  auto values = [](const dl::matrix& m) { return dl::vector(m); };
+
+  // scalar, row and column operands repeat over the missing axes
+  ASSERT(values(A.broadcast(BROADCAST_ADD, S)) == dl::vector({3,4,5,6,7,8}))
+  ASSERT(values(A.broadcast(BROADCAST_SUB, R)) == dl::vector({0,2,4,3,5,7}))
+  ASSERT(values(A.broadcast(BROADCAST_MUL, C)) ==
+    dl::vector({10,20,30,80,100,120}))
+  ASSERT(values(A.broadcast(BROADCAST_ADD, A)) ==
+    dl::vector({2,4,6,8,10,12}))
+
+  // element multiply broadcasts either operand
+  ASSERT(values(A & R) == dl::vector({1,0,-3,4,0,-6}))
+  ASSERT(values(C & A) == dl::vector({10,20,30,80,100,120}))
+  ASSERT(values(S * A) == dl::vector({2,4,6,8,10,12}))
+
+  // in place broadcast and fill
+  dl::matrix F(ctx, 2, 3);
+  F.fill(C);
+  ASSERT(values(F) == dl::vector({10,10,10,20,20,20}))
+  A.broadcast(BROADCAST_MUL, S, A);
+  ASSERT(values(A) == dl::vector({2,4,6,8,10,12}))
+
+  // unbatched operands repeat over samples, batched ones per sample
+  dl::matrix B(ctx, 2, 2, 2, false), BS(ctx, 1, 1, 2, false);
+  dl::matrix BR(ctx, 1, 2, 2, false), BC(ctx, 2, 1, 2, false);
+  B = {1,2,3,4, 5,6,7,8};
+  BS = {1,-1};
+  BR = {1,2, 3,4};
+  BC = {1,2, 3,4};
+  dl::matrix SR(ctx, 1, 2), SC(ctx, 2, 1);
+  SR = {10,20};
+  SC = {10,20};
+  ASSERT(values(B.broadcast(BROADCAST_MUL, BS)) ==
+    dl::vector({1,2,3,4, -5,-6,-7,-8}))
+  ASSERT(values(B.broadcast(BROADCAST_SUB, BR)) ==
+    dl::vector({0,0,2,2, 2,2,4,4}))
+  ASSERT(values(B.broadcast(BROADCAST_ADD, BC)) ==
+    dl::vector({2,3,5,6, 8,9,11,12}))
+  ASSERT(values(B.broadcast(BROADCAST_ADD, SR)) ==
+    dl::vector({11,22,13,24, 15,26,17,28}))
+  ASSERT(values(B.broadcast(BROADCAST_ADD, SC)) ==
+    dl::vector({11,12,23,24, 15,16,27,28}))
+  dl::matrix U(ctx, 2, 2);
+  U = {1,1,1,1};
+  dl::matrix UB = U.broadcast(BROADCAST_MUL, BS);
+  ASSERT(UB.batch() == 2)
+  ASSERT(values(UB) == dl::vector({1,1,1,1, -1,-1,-1,-1}))
+
+  // inner products per sample
+  dl::matrix D(ctx, 1, 1);
+  B.dots(B, D);
+  ASSERT(D.batch() == 2)
+  ASSERT(values(D) == dl::vector({30, 174}))
+
+  // contexts without a broadcast kernel run on host copies
+  HalfContext<dl::base_t> half;
+  Matrix<dl::base_t,HalfMatrix> H(half, 2, 2), HR(half, 1, 2);
+  H = {1,2,3,4};
+  HR = {1,-1};
+  dl::vector hv = H.broadcast(BROADCAST_MUL, HR);
+  ASSERT(hv == dl::vector({1,-2,3,-4}))
+
+  // operands that do not broadcast are rejected
+  dl::matrix X(ctx, 3, 2);
+  bool error = false;
+  try {
+    A.broadcast(BROADCAST_ADD, X);
+  }
+  catch (const std::runtime_error&) {
+    error = true;
+  }
+  ASSERT(error)
+  TEST_END()
+}
+
 void test_function_derivative(dl::context& ctx) {
   TEST_BEGIN("function Derivative")
   // matrix variables
@@ -363,6 +1384,13 @@ void test_function_constant(dl::context& ctx) {
   mr.set({0,0,0,0,0,0});
   fc->backward(md);
 
+  ASSERT(fc->derivative() == mr)
+
+  // repeated backward allocates nothing
+  auto stats = ctx.get_stats();
+  fc->backward(md);
+  ASSERT(ctx.get_stats().hits == stats.hits)
+  ASSERT(ctx.get_stats().misses == stats.misses)
   ASSERT(fc->derivative() == mr)
   TEST_END()
 }
@@ -385,6 +1413,14 @@ void test_function_variable(dl::context& ctx) {
   // numerival derivative
 
   ASSERT(fc->derivative() == md)
+
+  // accumulation allocates nothing
+  auto stats = ctx.get_stats();
+  fc->backward(md);
+  fc->backward(md);
+  ASSERT(ctx.get_stats().hits == stats.hits)
+  ASSERT(ctx.get_stats().misses == stats.misses)
+  ASSERT(fc->derivative() == md * 3.0)
   TEST_END()
 }
 
@@ -519,6 +1555,26 @@ void test_function_product(dl::context& ctx) {
 
   ASSERT(fa->derivative() == dfda_00_num)
   ASSERT(fb->derivative() == dfdb_00_num)
+
+  // derivative index [0,1]
+  std::unique_ptr<dl::variable> fc(new dl::variable(new dl::matrix(*ma)));
+  std::unique_ptr<dl::variable> fd(new dl::variable(new dl::matrix(*mb)));
+  std::unique_ptr<dl::product> g(new dl::product(fc.get(), fd.get()));
+  dv.set({0,1,0,0});
+  g->forward();
+  g->backward(dv);
+
+  ASSERT(fc->derivative() == dfdx(*g, 0, 1, fc->value()))
+  ASSERT(fd->derivative() == dfdx(*g, 0, 1, fd->value()))
+
+  // gemm with transposed operands and accumulation
+  dl::matrix mg(ctx, 2, 2);
+  mg.set(1);
+  mg.gemm(true, true, 2, *mb, *ma, 1);
+  dl::matrix mh(ctx, 2, 2);
+  mh.set({101,245,101,245});
+
+  ASSERT(mg == mh)
   TEST_END()
 }
 
@@ -664,6 +1720,184 @@ void test_function_summation(dl::context& ctx) {
   TEST_END()
 }
 
+void test_function_batch(dl::context& ctx) {
+  TEST_BEGIN("function Batch")
+
+  dl::vector vw({0.1, -0.2, 0.3, 0.4}), vx({1, 2, -3, 4, 5, -6});
+
+  // a batch of 3 inputs through one graph
+  dl::variable w(new dl::matrix(ctx, 2, 2));
+  dl::variable x(new dl::matrix(ctx, 2, 1, 3, true));
+  w.value() = vw;
+  x.value() = vx;
+  dl::product wx(&w, &x);
+  dl::exponent e(&wx);
+  dl::summation f(&e);
+
+  auto& y = f.forward();
+  ASSERT(y.rows() == 1 && y.cols() == 1 && y.batch() == 3)
+
+  dl::matrix d(ctx, 1, 1, 3, false);
+  d = dl::vector({1, 0.5, 2});
+  f.backward(d);
+  ASSERT(w.derivative().batch() == 1)
+  ASSERT(x.derivative().batch() == 3)
+
+  // the same as one graph per sample
+  dl::vector fy = y, dx = x.derivative(), dw(4, 0);
+  dl::vector vd = d;
+  for (int i=0; i<3; i++) {
+    dl::variable ws(new dl::matrix(ctx, 2, 2));
+    dl::variable xs(new dl::matrix(ctx, 2, 1));
+    ws.value() = vw;
+    xs.value() = dl::vector(vx.begin() + 2 * i, vx.begin() + 2 * i + 2);
+    dl::product wxs(&ws, &xs);
+    dl::exponent es(&wxs);
+    dl::summation fs(&es);
+
+    ASSERT(std::abs(fs.forward().S() - fy[i]) < EPS)
+
+    dl::matrix ds(ctx, 1, 1);
+    ds = vd[i];
+    fs.backward(ds);
+    dl::vector dxs = xs.derivative(), dws = ws.derivative();
+    ASSERT(std::abs(dxs[0] - dx[2 * i]) < EPS)
+    ASSERT(std::abs(dxs[1] - dx[2 * i + 1]) < EPS)
+    for (int j=0; j<4; j++) {
+      dw[j] += dws[j];
+    }
+  }
+
+  dl::vector bw = w.derivative();
+  for (int j=0; j<4; j++) {
+    ASSERT(std::abs(bw[j] - dw[j]) < EPS)
+  }
+  TEST_END()
+}
+
+void test_function_reduce(dl::context& ctx) {
+  TEST_BEGIN("function Reduce")
+
+  for (auto op: {REDUCE_SUM, REDUCE_MEAN, REDUCE_MAX, REDUCE_LOGSUMEXP}) {
+    for (auto axis: {AXIS_ROWS, AXIS_COLS}) {
+      auto mx = new dl::matrix(ctx, 3, 4);
+      *mx = {0.3, -1.2, 0.8, 0.1, 1.5, 0.4, -0.6, 0.9, -0.2, 0.7, 1.1, -0.9};
+      dl::variable x(mx);
+      dl::reduction f(&x, op, axis);
+
+      // dE/dx with all ones dE/df is the sum of df/dx over f
+      auto& y = f.forward();
+      dl::matrix d(ctx, y.rows(), y.cols());
+      d = 1;
+      f.backward(d);
+
+      dl::matrix num(ctx, 3, 4);
+      num = 0;
+      int rows = y.rows(), cols = y.cols();
+      for (int r=0; r<rows; r++) {
+        for (int c=0; c<cols; c++) {
+          num += dfdx(f, r, c, *mx);
+        }
+      }
+      ASSERT(x.derivative() == num)
+    }
+  }
+  TEST_END()
+}
+
+void test_function_broadcast(dl::context& ctx) {
+  TEST_BEGIN("function Broadcast")
+
+  auto ma = new dl::matrix(ctx, 3, 4);
+  auto ms = new dl::matrix(ctx, 1, 1);
+  auto mr = new dl::matrix(ctx, 1, 4);
+  auto mc = new dl::matrix(ctx, 3, 1);
+  *ma = {0.3, -1.2, 0.8, 0.1, 1.5, 0.4, -0.6, 0.9, -0.2, 0.7, 1.1, -0.9};
+  *ms = {1.5};
+  *mr = {0.5, -0.5, 2, 1};
+  *mc = {-1, 0.5, 2};
+
+  dl::variable a(ma), s(ms), r(mr), c(mc);
+
+  // (s * (a + r) - c) & a & r summed, every operand is broadcast
+  dl::addition ar(&a, &r);
+  dl::product sar(&s, &ar);
+  dl::subtract sub(&sar, &c);
+  dl::element ea(&sub, &a);
+  dl::element er(&r, &ea);
+  dl::summation f(&er);
+
+  auto& y = f.forward();
+  ASSERT(y.rows() == 1 && y.cols() == 1)
+
+  dl::matrix d(ctx, 1, 1);
+  d = 1;
+  f.backward(d);
+
+  ASSERT(a.derivative() == dfdx(f, 0, 0, *ma))
+  ASSERT(s.derivative() == dfdx(f, 0, 0, *ms))
+  ASSERT(r.derivative() == dfdx(f, 0, 0, *mr))
+  ASSERT(c.derivative() == dfdx(f, 0, 0, *mc))
+
+  // the smaller operand on the left
+  dl::variable b(new dl::matrix(ctx, 3, 4)), v(new dl::matrix(ctx, 1, 4));
+  b.value() = dl::vector(*ma);
+  v.value() = dl::vector(*mr);
+  dl::subtract vb(&v, &b);
+  dl::element bv(&vb, &b);
+  dl::summation g(&bv);
+  g.forward();
+  g.backward(d);
+  ASSERT(b.derivative() == dfdx(g, 0, 0, b.value()))
+  ASSERT(v.derivative() == dfdx(g, 0, 0, v.value()))
+  TEST_END()
+}
+
+void test_function_forward(dl::context& ctx) {
+  TEST_BEGIN("function Forward")
+
+  // matrix variables
+  auto ma = new dl::matrix(ctx, 2, 3);
+  auto mb = new dl::matrix(ctx, 3, 2);
+
+  // function variables
+  std::unique_ptr<dl::variable> fa(new dl::variable(ma));
+  std::unique_ptr<dl::variable> fb(new dl::variable(mb));
+
+  // set input values
+  ma->set({.1,.2,.3,.4,.5,.6});
+  mb->set({.6,.5,.4,.3,.2,.1});
+
+  // functions: f (a, b) = S(T(b) & a + a), g (a, b) = E(a * b) - E(a * b)
+  std::unique_ptr<dl::product> ab(new dl::product(fa.get(), fb.get()));
+  std::unique_ptr<dl::exponent> e(new dl::exponent(ab.get()));
+  std::unique_ptr<dl::transpose> t(new dl::transpose(fb.get()));
+  std::unique_ptr<dl::element> ta(new dl::element(t.get(), fa.get()));
+  std::unique_ptr<dl::addition> taa(new dl::addition(ta.get(), fa.get()));
+  std::unique_ptr<dl::subtract> ef(new dl::subtract(e.get(), e.get()));
+  std::unique_ptr<dl::summation> f(new dl::summation(taa.get()));
+  f->forward();
+  ef->forward();
+
+  // forward after the first allocates nothing
+  auto stats = ctx.get_stats();
+  for (int i=0; i<3; i++) {
+    f->refresh(true);
+    ef->refresh(true);
+    f->forward();
+    ef->forward();
+  }
+  ASSERT(ctx.get_stats().hits == stats.hits)
+  ASSERT(ctx.get_stats().misses == stats.misses)
+
+  // function value
+  dl::matrix mf(ctx, 1, 1);
+  mf.set(dl::matrix((mb->T() & *ma) + *ma).S());
+
+  ASSERT(f->forward() == mf)
+  TEST_END()
+}
+
 void test_json_error(dl::context& ctx) {
   TEST_BEGIN("json Validate")
 
@@ -784,6 +2018,560 @@ void test_network_update(dl::context& ctx, dl::resolver& r) {
   TEST_END()
 }
 
+void test_network_plan(dl::context& ctx, dl::resolver& r) {
+  TEST_BEGIN("network Plan")
+
+  // f (a, b) = T(E(a * b)) ** T(E(a * b))
+  Definition def;
+  def.set_name("plan");
+  def.add_variable("a");
+  def.add_variable("b");
+  def.add_expression("e1", "*", {"a", "b"}, {0, 0});
+  def.add_expression("e2", "E", {"e1"}, {0});
+  def.add_expression("e3", "T", {"e2"}, {0});
+  def.add_expression("return", "**", {"e3", "e3"}, {0, 0});
+
+  // e1 and e3 share a slot, the return value has its own buffer
+  MemoryPlan plan(def);
+  ASSERT(plan.slots() == 2)
+  ASSERT(plan.slot(0) == -1 && plan.slot(1) == -1)
+  ASSERT(plan.slot(2) >= 0 && plan.slot(2) == plan.slot(4))
+  ASSERT(plan.slot(3) >= 0 && plan.slot(3) != plan.slot(2))
+  ASSERT(plan.slot(5) == -1)
+
+  // the return value is found by name, not taken from the last record
+  Definition tail;
+  tail.set_name("tail");
+  tail.add_variable("a");
+  tail.add_expression("e1", "E", {"a"}, {0});
+  tail.add_expression("return", "T", {"e1"}, {0});
+  tail.add_expression("e2", "E", {"return"}, {0});
+  MemoryPlan tail_plan(tail);
+  ASSERT(tail_plan.slot(tail.get_id("return")) == -1)
+  ASSERT(tail_plan.slot(1) >= 0 && tail_plan.slot(1) == tail_plan.slot(3))
+
+  // create runtime
+  Dictionary dict;
+  dl::timeline timeline;
+  std::vector<dl::function*> no_args;
+  int index = timeline.add_runtime(0, dict, def, no_args);
+  auto rt = timeline.get_runtime(0, index);
+  auto ma = new dl::matrix(ctx, 2, 3);
+  auto mb = new dl::matrix(ctx, 3, 2);
+  static_cast<dl::variable*>(rt->variables()[0])->set(ma);
+  static_cast<dl::variable*>(rt->variables()[1])->set(mb);
+
+  // planned forward matches the unplanned one
+  *ma = {.1,.2,.3,.4,.5,.6};
+  *mb = {.6,.5,.4,.3,.2,.1};
+  dl::matrix unplanned = rt->forward();
+  rt->plan(plan);
+  ASSERT(rt->forward() == unplanned)
+
+  // and follows input changes
+  *ma = {.6,.5,.4,.3,.2,.1};
+  auto e = (*ma * *mb).E().T();
+  rt->refresh(true);
+  ASSERT(rt->forward() == (e & e))
+
+  // slot sharing values are gone so backward is rejected
+  dl::matrix d(ctx, 2, 2);
+  d = 1;
+  bool error = false;
+  try {
+    rt->backward(d);
+  }
+  catch (const std::runtime_error&) {
+    error = true;
+  }
+  ASSERT(error)
+  TEST_END()
+}
+
+void test_network_steps(dl::context& ctx, dl::resolver& r) {
+  TEST_BEGIN("network Steps")
+
+  // g (x) = E(x)
+  Definition inner;
+  inner.set_name("inner");
+  inner.add_constant("x");
+  inner.add_expression("return", "E", {"x"}, {0});
+
+  // f (a, b) = g(a * b) + a * b
+  Definition def;
+  def.set_name("steps");
+  def.add_import("g", &inner);
+  def.add_variable("a");
+  def.add_variable("b");
+  def.add_expression("e1", "*", {"a", "b"}, {0, 0});
+  def.add_expression("e2", "g", {"e1"}, {0});
+  def.add_expression("return", "+", {"e2", "e1"}, {0, 0});
+
+  Dictionary dict;
+  dl::timeline timeline;
+  std::vector<dl::function*> no_args;
+  auto rt = timeline.get_runtime(0, timeline.add_runtime(0, dict, def,
+    no_args));
+
+  // operators and the child runtime in topological order
+  auto& exprs = rt->expressions();
+  ASSERT(rt->steps().size() == 3)
+  ASSERT(rt->steps()[0] == exprs[2])
+  ASSERT(rt->steps()[1] == exprs[3])
+  ASSERT(rt->steps()[2] == exprs[4])
+  auto child = static_cast<dl::runtime*>(exprs[3]);
+  ASSERT(child->steps().size() == 1)
+
+  auto ma = new dl::matrix(ctx, 2, 2);
+  auto mb = new dl::matrix(ctx, 2, 2);
+  static_cast<dl::variable*>(rt->variables()[0])->set(ma);
+  static_cast<dl::variable*>(rt->variables()[1])->set(mb);
+  *ma = {.1,.2,.3,.4};
+  *mb = {.4,.3,.2,.1};
+  dl::matrix ab = *ma * *mb;
+  ASSERT(rt->forward() == dl::matrix(ab.E() + ab))
+
+  // a refreshed runtime runs its plan again
+  *ma = {.4,.3,.2,.1};
+  ab = *ma * *mb;
+  timeline.refresh();
+  ASSERT(rt->forward() == dl::matrix(ab.E() + ab))
+
+  // steps take their transient matrices from the step arena
+  ctx.reset_stats();
+  for (int i=0; i<2; i++) {
+    timeline.refresh();
+    rt->forward();
+    rt->backward(dl::matrix(ctx, 2, 2));
+  }
+  ASSERT(ctx.get_stats().arena_hits > 0)
+
+  // an element-wise product is one step, not followed by a transpose
+  Definition element;
+  element.set_name("element");
+  element.add_variable("a");
+  element.add_variable("b");
+  element.add_expression("return", "**", {"a", "b"}, {0, 0});
+  dl::timeline et;
+  auto ert = et.get_runtime(0, et.add_runtime(0, dict, element, no_args));
+  ASSERT(ert->expressions().size() == 3)
+  ASSERT(ert->steps().size() == 1)
+  auto ea = new dl::matrix(ctx, 2, 3);
+  auto eb = new dl::matrix(ctx, 2, 3);
+  static_cast<dl::variable*>(ert->variables()[0])->set(ea);
+  static_cast<dl::variable*>(ert->variables()[1])->set(eb);
+  *ea = {1,2,3,4,5,6};
+  *eb = {6,5,4,3,2,1};
+  ASSERT(ert->forward() == (*ea & *eb))
+
+  // a deep chain runs without recursing through its inputs
+  int depth = 100000;
+  Definition chain;
+  chain.set_name("chain");
+  chain.add_variable("x0");
+  for (int i=1; i<=depth; i++) {
+    std::string x = "x" + std::to_string(i);
+    std::string p = "x" + std::to_string(i - 1);
+    chain.add_expression(x.c_str(), "T", {p.c_str()}, {0});
+  }
+  dl::timeline deep;
+  auto drt = deep.get_runtime(0, deep.add_runtime(0, dict, chain, no_args));
+  ASSERT(drt->steps().size() == depth)
+  auto mx = new dl::matrix(ctx, 2, 3);
+  *mx = {1,2,3,4,5,6};
+  static_cast<dl::variable*>(drt->variables()[0])->set(mx);
+  ASSERT(drt->forward() == *mx)
+  TEST_END()
+}
+
+void test_network_scheduler(dl::context& ctx, dl::resolver& r) {
+  TEST_BEGIN("network Scheduler")
+
+  Scheduler scheduler(4);
+  ASSERT(scheduler.size() == 4)
+
+  // 0 -> 2, 1 -> 2, 1 -> 3, 2 -> 4, 3 -> 4, 5 alone
+  std::vector<std::vector<int>> inputs = {{}, {}, {0, 1}, {1}, {2, 3}, {}};
+  for (auto reverse: {false, true}) {
+    std::atomic<int> clock(0);
+    std::vector<int> stamp(inputs.size(), -1);
+    scheduler.run(inputs, reverse, [&](std::size_t i) {
+      stamp[i] = clock++;
+    });
+    bool ordered = true;
+    for (int i=0; i<inputs.size(); i++) {
+      ordered = ordered && stamp[i] >= 0;
+      for (auto j: inputs[i]) {
+        ordered = ordered && (reverse ? stamp[j] > stamp[i] :
+          stamp[j] < stamp[i]);
+      }
+    }
+    ASSERT(ordered)
+  }
+
+  // a failing node stops the run and its error reaches the caller
+  bool error = false;
+  try {
+    scheduler.run(inputs, false, [](std::size_t i) {
+      if (i == 2) {
+        throw std::runtime_error("node failed");
+      }
+    });
+  }
+  catch (const std::runtime_error&) {
+    error = true;
+  }
+  ASSERT(error)
+
+  // f (a, b) = E(a * b) + T(b * a) + a ** b, three independent branches
+  Definition def;
+  def.set_name("branches");
+  def.add_variable("a");
+  def.add_variable("b");
+  def.add_expression("e1", "*", {"a", "b"}, {0, 0});
+  def.add_expression("e2", "E", {"e1"}, {0});
+  def.add_expression("e3", "*", {"b", "a"}, {0, 0});
+  def.add_expression("e4", "T", {"e3"}, {0});
+  def.add_expression("e5", "**", {"a", "b"}, {0, 0});
+  def.add_expression("e6", "+", {"e2", "e4"}, {0, 0});
+  def.add_expression("return", "+", {"e6", "e5"}, {0, 0});
+
+  Dictionary dict;
+  dl::timeline timeline;
+  std::vector<dl::function*> no_args;
+  timeline.set_scheduler(&scheduler);
+  auto rt = timeline.get_runtime(0, timeline.add_runtime(0, dict, def,
+    no_args));
+  ASSERT(rt->inputs()[1] == std::vector<int>({0}))
+  ASSERT(rt->inputs()[6] == std::vector<int>({5, 4}))
+
+  auto ma = new dl::matrix(ctx, 2, 2);
+  auto mb = new dl::matrix(ctx, 2, 2);
+  static_cast<dl::variable*>(rt->variables()[0])->set(ma);
+  static_cast<dl::variable*>(rt->variables()[1])->set(mb);
+  *ma = {.1,.2,.3,.4};
+  *mb = {.4,.3,.2,.1};
+  dl::matrix e = dl::matrix((*ma * *mb).E() + (*mb * *ma).T()) + (*ma & *mb);
+  ASSERT(rt->forward() == e)
+
+  // the same values serially
+  timeline.set_scheduler(NULL);
+  timeline.refresh();
+  ASSERT(rt->forward() == e)
+
+  // g (a, b) = E(a * b) + T(a), T(a) does not depend on a * b but reuses
+  // its slot once E(a * b) has read it
+  Definition shared;
+  shared.set_name("shared");
+  shared.add_variable("a");
+  shared.add_variable("b");
+  shared.add_expression("e1", "*", {"a", "b"}, {0, 0});
+  shared.add_expression("e2", "E", {"e1"}, {0});
+  shared.add_expression("e3", "T", {"a"}, {0});
+  shared.add_expression("return", "+", {"e2", "e3"}, {0, 0});
+  MemoryPlan plan(shared);
+  ASSERT(plan.slot(2) >= 0 && plan.slot(2) == plan.slot(4))
+
+  dl::timeline planned;
+  planned.set_scheduler(&scheduler);
+  auto prt = planned.get_runtime(0, planned.add_runtime(0, dict, shared,
+    no_args));
+  int n = 128;
+  dl::vector va(n * n), vb(n * n);
+  for (int i=0; i<n * n; i++) {
+    va[i] = (i % 7) * 0.001;
+    vb[i] = (i % 5) * 0.002;
+  }
+  auto pa = new dl::matrix(ctx, n, n);
+  auto pb = new dl::matrix(ctx, n, n);
+  *pa = va;
+  *pb = vb;
+  static_cast<dl::variable*>(prt->variables()[0])->set(pa);
+  static_cast<dl::variable*>(prt->variables()[1])->set(pb);
+
+  // scheduled forwards of the planned runtime match the unplanned one
+  dl::matrix unplanned = prt->forward();
+  prt->plan(plan);
+  bool same = true;
+  for (int i=0; i<50; i++) {
+    planned.refresh();
+    same = same && (prt->forward() == unplanned);
+  }
+  ASSERT(same)
+  TEST_END()
+}
+
+void test_network_tape(dl::context& ctx, dl::resolver& r) {
+  TEST_BEGIN("network Tape")
+
+  // x0 = x, xi = xi-1 + xi-1 has 2^n paths from the return value to x
+  int depth = 40;
+  Definition chain;
+  chain.set_name("chain");
+  chain.add_variable("x0");
+  for (int i=1; i<=depth; i++) {
+    std::string x = "x" + std::to_string(i);
+    std::string p = "x" + std::to_string(i - 1);
+    chain.add_expression(x.c_str(), "+", {p.c_str(), p.c_str()}, {0, 0});
+  }
+
+  Dictionary dict;
+  std::vector<dl::function*> no_args;
+  dl::timeline deep;
+  auto drt = deep.get_runtime(0, deep.add_runtime(0, dict, chain, no_args));
+  auto vx = static_cast<dl::variable*>(drt->variables()[0]);
+  vx->set(new dl::matrix(ctx, 1, 1));
+  vx->value() = 1;
+  dl::matrix d(ctx, 1, 1);
+  d = 1;
+  drt->forward();
+  drt->backward(d);
+  ASSERT(vx->derivative().S() == std::pow(2.f, depth))
+
+  // f (a, b) = E(a * b) + a ** E(a * b), e1 and e2 feed two consumers
+  Definition def;
+  def.set_name("tape");
+  def.add_variable("a");
+  def.add_variable("b");
+  def.add_expression("e1", "*", {"a", "b"}, {0, 0});
+  def.add_expression("e2", "E", {"e1"}, {0});
+  def.add_expression("e3", "**", {"a", "e2"}, {0, 0});
+  def.add_expression("return", "+", {"e2", "e3"}, {0, 0});
+
+  dl::vector va = {.1,.2,.3,.4}, vb = {.4,.3,.2,.1}, vd = {1,2,3,4};
+  dl::matrix dd(ctx, 2, 2);
+  dd = vd;
+
+  // the same function outside a runtime propagates every path at once
+  dl::variable a(new dl::matrix(ctx, 2, 2)), b(new dl::matrix(ctx, 2, 2));
+  a.value() = va;
+  b.value() = vb;
+  dl::product e1(&a, &b);
+  dl::exponent e2(&e1);
+  dl::element e3(&a, &e2);
+  dl::addition f(&e2, &e3);
+  f.forward();
+  f.backward(dd);
+
+  // serial and scheduled reverse passes
+  Scheduler scheduler(4);
+  for (auto sched: {(Scheduler*)NULL, &scheduler}) {
+    dl::timeline timeline;
+    timeline.set_scheduler(sched);
+    auto rt = timeline.get_runtime(0, timeline.add_runtime(0, dict, def,
+      no_args));
+    auto ra = static_cast<dl::variable*>(rt->variables()[0]);
+    auto rb = static_cast<dl::variable*>(rt->variables()[1]);
+    ra->set(new dl::matrix(ctx, 2, 2));
+    rb->set(new dl::matrix(ctx, 2, 2));
+    ra->value() = va;
+    rb->value() = vb;
+    ASSERT(rt->forward() == f.forward())
+    rt->backward(dd);
+    ASSERT(ra->derivative() == a.derivative())
+    ASSERT(rb->derivative() == b.derivative())
+  }
+
+  // f (x, w)[t] = (x * w)[t] + (x * w)[t-1], backward of the last frame
+  // reaches the frame before it
+  Definition rec;
+  rec.set_name("recurrent");
+  rec.add_constant("x");
+  rec.add_variable("w");
+  rec.add_expression("e1", "*", {"x", "w"}, {0, 0});
+  rec.add_expression("return", "+", {"e1", "e1"}, {0, -1});
+
+  int time = 3;
+  dl::timeline frames;
+  for (int t=0; t<time; t++) {
+    auto rt = frames.get_runtime(t, frames.add_runtime(t, dict, rec,
+      no_args));
+    auto x = new dl::matrix(ctx, 1, 1);
+    *x = 1;
+    static_cast<dl::constant*>(rt->constants()[0])->set(x);
+  }
+  auto w = static_cast<dl::variable*>(
+    frames.get_runtime(0, 0)->variables()[0]);
+  w->set(new dl::matrix(ctx, 1, 1));
+  w->value() = 1;
+  auto last = frames.get_runtime(time - 1, 0);
+  for (int t=0; t<time; t++) {
+    frames.get_runtime(t, 0)->forward();
+  }
+  last->backward(d);
+  ASSERT(w->derivative().S() == 2)
+
+  // a gradient left pending by a pass over one frame is dropped once the
+  // timeline is refreshed
+  w->derivative() = 0;
+  last->propagate(d);
+  ASSERT(w->derivative().S() == 1)
+  frames.refresh();
+  for (int t=0; t<time; t++) {
+    frames.get_runtime(t, 0)->forward();
+  }
+  frames.get_runtime(time - 2, 0)->reverse();
+  ASSERT(w->derivative().S() == 1)
+  TEST_END()
+}
+
+void test_network_dirty(dl::context& ctx, dl::resolver& r) {
+  TEST_BEGIN("network Dirty")
+
+  // g (x) = E(x)
+  Definition inner;
+  inner.set_name("inner");
+  inner.add_constant("x");
+  inner.add_expression("return", "E", {"x"}, {0});
+
+  // f (a, b) = g(a) + T(b)
+  Definition def;
+  def.set_name("dirty");
+  def.add_import("g", &inner);
+  def.add_constant("a");
+  def.add_constant("b");
+  def.add_expression("e1", "g", {"a"}, {0});
+  def.add_expression("e2", "T", {"b"}, {0});
+  def.add_expression("return", "+", {"e1", "e2"}, {0, 0});
+
+  Dictionary dict;
+  std::vector<dl::function*> no_args;
+  Scheduler scheduler(2);
+  for (auto sched: {(Scheduler*)NULL, &scheduler}) {
+    dl::timeline timeline;
+    timeline.set_scheduler(sched);
+    auto rt = timeline.get_runtime(0, timeline.add_runtime(0, dict, def,
+      no_args));
+    auto ca = static_cast<dl::constant*>(rt->constants()[0]);
+    auto cb = static_cast<dl::constant*>(rt->constants()[1]);
+    ca->set(new dl::matrix(ctx, 2, 2));
+    cb->set(new dl::matrix(ctx, 2, 2));
+    ca->value() = {1,2,3,4};
+    cb->value() = {4,3,2,1};
+    ASSERT(rt->forward() == dl::matrix(ca->value().E() + cb->value().T()))
+
+    // an unchanged input recomputes nothing
+    auto& exprs = rt->expressions();
+    auto e1 = exprs[2]->version(), e2 = exprs[3]->version();
+    auto e3 = exprs[4]->version();
+    rt->forward();
+    ASSERT(exprs[2]->version() == e1)
+    ASSERT(exprs[3]->version() == e2)
+    ASSERT(exprs[4]->version() == e3)
+
+    // a touched input recomputes its cone only
+    ca->value() = {0,1,0,1};
+    ca->touch();
+    ASSERT(rt->forward() == dl::matrix(ca->value().E() + cb->value().T()))
+    ASSERT(exprs[2]->version() == e1 + 1)
+    ASSERT(exprs[3]->version() == e2)
+    ASSERT(exprs[4]->version() == e3 + 1)
+
+    cb->value() = {1,1,2,2};
+    cb->touch();
+    ASSERT(rt->forward() == dl::matrix(ca->value().E() + cb->value().T()))
+    ASSERT(exprs[2]->version() == e1 + 1)
+    ASSERT(exprs[3]->version() == e2 + 1)
+    ASSERT(exprs[4]->version() == e3 + 2)
+
+    // a refreshed timeline recomputes every step
+    timeline.refresh();
+    rt->forward();
+    ASSERT(exprs[2]->version() == e1 + 2)
+    ASSERT(exprs[3]->version() == e2 + 2)
+    ASSERT(exprs[4]->version() == e3 + 3)
+  }
+  TEST_END()
+}
+
+void test_network_checkpoints(dl::context& ctx, dl::resolver& r) {
+  TEST_BEGIN("network Checkpoints")
+
+  // f (x, w)[t] = (x * w)[t-1] ** (x * w)[t] + (x * w)[t-2]
+  Definition def;
+  def.set_name("checkpoints");
+  def.add_constant("x");
+  def.add_variable("w");
+  def.add_expression("e1", "*", {"x", "w"}, {0, 0});
+  def.add_expression("e2", "**", {"e1", "e1"}, {-1, 0});
+  def.add_expression("return", "+", {"e2", "e1"}, {0, -2});
+
+  // the same sequence with every frame kept and with checkpoints, in two
+  // spaces that run forward and backward one after the other
+  int time = 10;
+  Dictionary dict;
+  std::vector<dl::function*> no_args;
+  std::vector<dl::matrix> outputs;
+  dl::matrix dw(ctx, 2, 2);
+  for (auto k: {0, 4}) {
+    dl::timeline timeline;
+    timeline.set_checkpoints(k);
+    for (int t=0; t<time; t++) {
+      for (int space=0; space<2; space++) {
+        auto rt = timeline.get_runtime(t, timeline.add_runtime(t, dict, def,
+          no_args));
+        auto x = new dl::matrix(ctx, 1, 2);
+        *x = {.1f * t, .2f};
+        static_cast<dl::constant*>(rt->constants()[0])->set(x);
+      }
+    }
+    std::vector<dl::variable*> w;
+    for (int space=0; space<2; space++) {
+      w.push_back(static_cast<dl::variable*>(
+        timeline.get_runtime(0, space)->variables()[0]));
+      w.back()->set(new dl::matrix(ctx, 2, 2));
+      w.back()->value() = {.5,-.5,.25,1};
+    }
+
+    // the first two frames of a segment are read by no later segment and
+    // dropped, the last two frames are still read when forward ends
+    auto dropped = [&](int t) {
+      return k > 0 && t % k < 2 && t + 2 < time;
+    };
+    timeline.forward(0);
+    timeline.forward(1);
+    for (int t=0; t<time; t++) {
+      ASSERT(timeline.released(t, 0) == dropped(t))
+      ASSERT(timeline.released(t, 1) == dropped(t))
+    }
+
+    std::vector<dl::matrix> d;
+    std::vector<const dl::matrix*> pd;
+    d.reserve(time);
+    for (int t=0; t<time; t++) {
+      d.emplace_back(ctx, 1, 2);
+      d.back() = {1, .5f * t};
+      pd.push_back((t % 3 == 0) ? &d.back() : NULL);
+    }
+
+    // backward of one space leaves the frames of the other as they are
+    timeline.backward(0, pd);
+    for (int t=0; t<time; t++) {
+      ASSERT(timeline.released(t, 1) == dropped(t))
+    }
+    timeline.backward(1, pd);
+
+    for (int space=0; space<2; space++) {
+      for (int t=0; t<time; t++) {
+        auto& v = timeline.get_runtime(t, space)->forward();
+        if (k == 0 && space == 0) {
+          outputs.push_back(v);
+        }
+        else {
+          ASSERT(v == outputs[t])
+        }
+      }
+      if (k == 0 && space == 0) {
+        dw = w[space]->derivative();
+      }
+      else {
+        ASSERT(w[space]->derivative() == dw)
+      }
+    }
+  }
+  TEST_END()
+}
+
 void test_network_gpu(dl::context& ctx, dl::resolver& r) {
   TEST_BEGIN("network GPU")
 
@@ -793,13 +2581,32 @@ void test_network_gpu(dl::context& ctx, dl::resolver& r) {
 
 void test_matrix(dl::context& ctx) {
   test_matrix_context(ctx);
+  test_matrix_pool(ctx);
+  test_matrix_arena(ctx);
+  test_matrix_stats(ctx);
+  test_matrix_pages(ctx);
+  test_matrix_threads(ctx);
   test_matrix_rows_cols(ctx);
   test_matrix_set_get(ctx);
   test_matrix_addition(ctx);
   test_matrix_subtract(ctx);
   test_matrix_product(ctx);
+  test_matrix_fixed(ctx);
+#ifdef DL_BLAS
+  test_matrix_blas(ctx);
+#endif
   test_matrix_element(ctx);
+  test_matrix_compound(ctx);
+  test_matrix_expression(ctx);
   test_matrix_transpose(ctx);
+  test_matrix_simd(ctx);
+  test_matrix_parallel(ctx);
+  test_matrix_half(ctx);
+  test_matrix_quant(ctx);
+  test_matrix_sparse(ctx);
+  test_matrix_batch(ctx);
+  test_matrix_reduce(ctx);
+  test_matrix_broadcast(ctx);
   test_matrix_exponent(ctx);
   test_matrix_summation(ctx);
 }
@@ -815,6 +2622,10 @@ void test_function(dl::context& ctx) {
   test_function_transpose(ctx);
   test_function_exponent(ctx);
   test_function_summation(ctx);
+  test_function_batch(ctx);
+  test_function_reduce(ctx);
+  test_function_broadcast(ctx);
+  test_function_forward(ctx);
 }
 
 void test_json(dl::context& ctx) {
@@ -838,6 +2649,12 @@ void test_network(dl::context& ctx) {
   test_network_forward(ctx, res);
   test_network_backward(ctx, res);
   test_network_update(ctx, res);
+  test_network_plan(ctx, res);
+  test_network_steps(ctx, res);
+  test_network_scheduler(ctx, res);
+  test_network_tape(ctx, res);
+  test_network_dirty(ctx, res);
+  test_network_checkpoints(ctx, res);
   test_network_gpu(ctx, res);
 }
 